@@ -0,0 +1,47 @@
+#ifndef CLK_SAMPLER_H
+#define CLK_SAMPLER_H
+
+#include <stdint.h>
+
+// Clock-free sampling: instead of decoding the CPU clock signal, the falling edges of
+// the clock are calculated from its period and the time of its first falling edge.
+//
+// The extractors then only decode the signals they sample. All signals change on the
+// rising edge of the clock, so when one of them changes, all the falling edges since
+// the previous value change sample the same values.
+class ClkSampler
+{
+public:
+    ClkSampler() : period(0), firstFallingEdge(0), nextFallingEdge(0) {}
+    ClkSampler(uint64_t period, uint64_t firstFallingEdge) :
+        period(period), firstFallingEdge(firstFallingEdge), nextFallingEdge(firstFallingEdge) {}
+
+    bool enabled()  { return period != 0; };
+    void reset()    { nextFallingEdge = firstFallingEdge; };
+
+    // Returns the next falling edge that is before time, if any.
+    bool nextEdge(uint64_t time, uint64_t *edge)
+    {
+        if (nextFallingEdge >= time)
+            return false;
+
+        *edge = nextFallingEdge;
+        nextFallingEdge += period;
+        return true;
+    }
+
+    // Skip all falling edges before time, when nothing would be recorded for them anyway.
+    void skipUntil(uint64_t time)
+    {
+        if (nextFallingEdge >= time)
+            return;
+
+        nextFallingEdge += (time - nextFallingEdge + period - 1) / period * period;
+    }
+
+    uint64_t        period;
+    uint64_t        firstFallingEdge;
+    uint64_t        nextFallingEdge;
+};
+
+#endif
@@ -16,50 +16,69 @@ CpuTrace::CpuTrace(FstProcess & fstProc, FstSignal clk, FstSignal pcValid, FstSi
     pcValid(pcValid),
     pc(pc)
 {
-    init();
 }
 
-static void pcChangedCB(uint64_t time, FstSignal *signal, const unsigned char *value, void *userInfo)
+void CpuTrace::sample(uint64_t time)
 {
-    CpuTrace *cpuTrace = (CpuTrace *)userInfo;
+    if (curPcValidVal && fstProc.inTimeRange(time)){
+
+        if (verbose) LOG_INFO("instr retire: %ld, %08lx", time, curPcVal);
 
-    if (strstr((char *)value, "x") || strstr((char *)value, "z")){
-        return;
+        PcValue     pc = { time, curPcVal };
+        pcTrace.push_back(pc);
     }
+}
 
-    uint64_t valueInt = stol(string((const char *)value), nullptr, 2);
+// All signals changes on the rising edge of the clock. Everything is stable at the falling edge...
+static void clkChangedCB(uint64_t time, uint64_t value, void *userInfo)
+{
+    CpuTrace *cpuTrace = (CpuTrace *)userInfo;
 
-#if 0
-    LOG_DEBUG("%ld, %ud, %s, %s, %ld", time, signal->handle, signal->name.c_str(), value, valueInt);
-#endif
+    bool fallingEdge = cpuTrace->curClkVal == 1 && value == 0;
+    cpuTrace->curClkVal = value;
 
-    if (signal->handle == cpuTrace->pcValid.handle){
-        cpuTrace->curPcValidVal   = valueInt;
-        return;
+    if (fallingEdge){
+        cpuTrace->sample(time);
     }
+}
 
-    if (signal->handle == cpuTrace->pc.handle){
-        cpuTrace->curPcVal    = valueInt;
-        return;
-    }
+void CpuTrace::sampleUntil(uint64_t time)
+{
+    // The falling edges after the time range are sampled when the next time range is 
+    // decoded, with the values of that time.
+    time = fstProc.clipToTimeRange(time);
 
-    // All signals changes on the rising edge of the clock. Everything is stable at the falling edge...
-    if (signal->handle == cpuTrace->clk.handle && valueInt == 0){
-        if (cpuTrace->curPcValidVal){
+    if (!curPcValidVal){
+        clkSampler.skipUntil(time);
+    }
 
-            if (verbose) LOG_INFO("instr retire: %ld, %08lx", time, cpuTrace->curPcVal);
+    uint64_t edge;
+    while(clkSampler.nextEdge(time, &edge)){
+        sample(edge);
+    }
+}
 
-            PcValue     pc = { time, cpuTrace->curPcVal };
-            cpuTrace->pcTrace.push_back(pc);
-        }
+void CpuTrace::finish(uint64_t endTime)
+{
+    if (clkSampler.enabled()){
+        sampleUntil(endTime+1);
     }
 }
 
+// Clock-free mode: called before the new value is stored.
+static void signalChangedCB(uint64_t time, uint64_t value, void *userInfo)
+{
+    CpuTrace *cpuTrace = (CpuTrace *)userInfo;
+    cpuTrace->sampleUntil(time);
+}
+
 void CpuTrace::init()
 {
     vector<FstSignal *> sigs;
 
-    sigs.push_back(&clk);
+    if (!clkSampler.enabled()){
+        sigs.push_back(&clk);
+    }
     sigs.push_back(&pcValid);
     sigs.push_back(&pc);
 
@@ -75,11 +94,24 @@ void CpuTrace::init()
     }
 #endif
 
+    curClkVal       = 0;
     curPcValidVal   = 0;
     curPcVal        = 0;
 
-    fstProc.getValueChanges(sigs, pcChangedCB, (void *)this);
-
-    LOG_INFO("Nr CPU instructions: %ld", pcTrace.size());
+    if (clkSampler.enabled()){
+        clkSampler.reset();
+        fstProc.addHandler(&pcValid, signalChangedCB, (void *)this);
+        fstProc.addHandler(&pc, signalChangedCB, (void *)this);
+    }
+    else{
+        fstProc.addHandler(&clk, clkChangedCB, (void *)this);
+    }
+    fstProc.addTarget(&pcValid, &curPcValidVal);
+    fstProc.addTarget(&pc, &curPcVal);
 }
 
+
+void CpuTrace::append(CpuTrace &slice)
+{
+    pcTrace.append(slice.pcTrace);
+}
@@ -4,19 +4,32 @@
 #include <stdint.h>
 
 #include <FstProcess.h>
-
-struct PcValue
-{
-    uint64_t    time;
-    uint64_t    pc;
-};
+#include <ClkSampler.h>
+#include <PcTrace.h>
 
 class CpuTrace
 {
 public:
     CpuTrace(FstProcess & fstProc, FstSignal clk, FstSignal pcValid, FstSignal pc);
+
+    // Look up the signals in the FST file and subscribe to their value changes.
+    // Must be called before FstProcess::processValueChanges().
     void init();
 
+    // Record the instruction that retires at the falling edge of the clock at time.
+    void sample(uint64_t time);
+
+    // Clock-free mode: sample all falling edges before time. Called before a value change.
+    void sampleUntil(uint64_t time);
+
+    // Clock-free mode: sample the falling edges after the last value change, up to endTime.
+    // Must be called after FstProcess::processValueChanges().
+    void finish(uint64_t endTime);
+
+    // Move the PC values of a trace that was extracted for a later time range to the end
+    // of this one. The slice is left empty.
+    void append(CpuTrace &slice);
+
     // Object to manage access to FST file
     FstProcess &    fstProc;
 
@@ -25,14 +38,19 @@ public:
     FstSignal       pcValid;
     FstSignal       pc;
 
+    // When enabled, the clock signal isn't decoded.
+    ClkSampler      clkSampler;
+
     // Helper signals for the FST callbacks to extract the PC values
+    uint64_t        curClkVal;
     uint64_t        curPcValidVal;
     uint64_t        curPcVal;
 
     // All PC values in the FST trace
-    vector<PcValue>     pcTrace;
+    PcTrace             pcTrace;
 
-    vector<PcValue>::iterator pcTraceIt;
+    // Index of the current instruction
+    size_t              pcTraceIdx;
 };
 
 #endif
@@ -1,123 +1,115 @@
 
 #include <exception>
 #include <sstream>
+#include <fstream>
 
 #include "FstProcess.h"
+#include "FstReader.h"
+#include "VcdReader.h"
 #include "Logger.h"
 
 FstProcess::FstProcess(string fstFileName) :
-    fstFileName(fstFileName)
+    fstFileName(fstFileName),
+    progressHandler(nullptr),
+    progressUserInfo(nullptr),
+    progressInterval(0),
+    nextProgressTime(UINT64_MAX),
+    stopped(false),
+    timeRangeValid(false),
+    timeRangeStart(0),
+    timeRangeEnd(0),
+    hierIndexValid(false)
 {
-    fstCtx = fstReaderOpen(fstFileName.c_str());
-    if (fstCtx == NULL) {
-        stringstream ss;
-        ss << "Could not open file '" << fstFileName << "'";
-        throw runtime_error(ss.str());
+    if (VcdReader::isVcdFile(fstFileName)){
+        reader.reset(new VcdReader(fstFileName));
     }
+    else{
+        reader.reset(new FstReader(fstFileName));
+    }
+}
+
+void FstProcess::setTimeRange(uint64_t start, uint64_t end)
+{
+    timeRangeValid  = true;
+    timeRangeStart  = start;
+    timeRangeEnd    = end;
+
+    reader->setLimitTimeRange(start, end);
 }
 
-FstProcess::~FstProcess()
+void FstProcess::clrTimeRange(void)
 {
-    fstReaderClose(fstCtx);
+    timeRangeValid  = false;
+
+    reader->setUnlimitedTimeRange();
 }
 
 string FstProcess::infoStr(void)
 {
     stringstream ss;
 
-    const char *    curFlatScope                    = fstReaderGetCurrentFlatScope(fstCtx);
-    int             curScopeLen                     = fstReaderGetCurrentScopeLen(fstCtx);
-    int             doubleEndianMatchState          = fstReaderGetDoubleEndianMatchState(fstCtx);
-    uint64_t        dumpActivityChangeTime          = fstReaderGetDumpActivityChangeTime(fstCtx, 0);
-    unsigned char   dumpActivityChangeValue         = fstReaderGetDumpActivityChangeValue(fstCtx, 0);
-    int             fileType                        = fstReaderGetFileType(fstCtx);
-    int             fseekFailed                     = fstReaderGetFseekFailed(fstCtx);
-    uint64_t        memoryUsedByWriter              = fstReaderGetMemoryUsedByWriter(fstCtx);
-    uint32_t        numDumpActivityChanges          = fstReaderGetNumberDumpActivityChanges(fstCtx);
-
-//    void *          curScopeUserInfo                = fstReaderGetCurrentScopeUserInfo(fstCtx);
-//    fstHandle       maxHandle                       = fstReaderGetMaxHandle(fstCtx);
-//    char *          fstReaderGetValueFromHandleAtTime(fstCtx, uint64_t tim, fstHandle facidx, char *buf);
-//    int             facProcessMask          = fstReaderGetFacProcessMask(fstCtx, fstHandle facidx);
-
     ss << "============================================================" << endl;
     ss << "aliasCount: " << aliasCount() << endl;
-    ss << "curFlatScope: " << curFlatScope << endl;
-    ss << "curScopeLen: " << curScopeLen << endl;
     ss << "date: " << date() << endl;
-    ss << "doubleEndianMatchState: " << doubleEndianMatchState << endl;
-    ss << "dumpActivityChangeTime: " << dumpActivityChangeTime << endl;
-    ss << "dumpActivityChangeValue: " << (int)dumpActivityChangeValue << endl;
-    ss << "fileType: " << fileType << " (" << fileTypeStrings[fileType] << ")" << endl;
-    ss << "fseekFailed: " << fseekFailed << endl;
-    ss << "memoryUsedByWriter:" << memoryUsedByWriter << endl;
-    ss << "numDumpActivityChanges: " << numDumpActivityChanges << endl;
     ss << "scopeCount: " << scopeCount() << endl;
     ss << "startTime: " << startTime() << endl;
     ss << "endTime: " << endTime() << endl;
-    ss << "timeZero: " << timezero() << endl;
     ss << "timescale:" << timescale() << endl;
     ss << "valueChangeSectionCount: " << valueChangeSectionCount() << endl;
     ss << "varCount: " << varCount() << endl;
     ss << "Version string: " << version() << endl;
+    reader->addInfo(ss);
     ss << "============================================================" << endl;
 
-    // FIXME: move...
-    if (numDumpActivityChanges > 0){
-        LOG_ERROR("Blackout regions are not supported.");
-        exit(-2);
-    }
-
     return ss.str();
 }
 
+// Walk the full hierarchy once and record the handle of each variable by its full path.
+// When the same path exists more than once, the first one wins.
+void FstProcess::buildHierIndex()
+{
+    hierIndex.reserve(varCount());
+
+    reader->forEachVar([this](const string &fullName, uint32_t handle, uint32_t length){
+        hierIndex.emplace(fullName, FstVar{ handle, length });
+    });
+
+    hierIndexValid = true;
+    LOG_DEBUG("Hierarchy index: %ld variables", hierIndex.size());
+}
+
+// Look for and assign the fstHandle of a signal. 
+// Return true if the signal was found.
+bool FstProcess::assignHandle(FstSignal *signal)
+{
+    if (signal->hasHandle)
+        return true;
+
+    if (!hierIndexValid)
+        buildHierIndex();
+
+    auto it = hierIndex.find(signal->fullName());
+    if (it == hierIndex.end())
+        return false;
+
+    signal->hasHandle   = true;
+    signal->handle      = it->second.handle;
+    signal->length      = it->second.length;
+
+    return true;
+}
+
 // For a given list of signals, look for and assign the fstHandle
 // Return true if all signals are found. 
 bool FstProcess::assignHandles(vector<FstSignal *> &signals)
 {
-    struct fstHier *hier;
-    string curScopeName; 
-
-    bool sigNotFound;
-
-    fstReaderIterateHierRewind(fstCtx);
-    while((hier = fstReaderIterateHier(fstCtx))){
-
-        switch(hier->htyp){
-            case FST_HT_SCOPE: {
-                curScopeName = fstReaderPushScope(fstCtx, hier->u.scope.name, NULL);
-                LOG_DEBUG("curScopeName: %s", curScopeName.c_str());
-                break;
-            }
-
-            case FST_HT_UPSCOPE: {
-                curScopeName = fstReaderPopScope(fstCtx);
-                LOG_DEBUG("curScopeName: %s", curScopeName.c_str());
-                break;
-            }
-
-            case FST_HT_VAR: {
-                string curName = hier->u.var.name;
-                LOG_DEBUG("curName: %s", curName.c_str());
-
-                sigNotFound = false;
-                for(auto sig: signals){
-                    if (sig->hasHandle)
-                        continue;
-                    sigNotFound     = true;
-
-                    if (sig->scopeName == curScopeName && sig->name == curName){
-                        sig->hasHandle   = true;
-                        sig->handle      = hier->u.var.handle;
-                    }
-                }
-                break;
-            }
-        }
+    bool allFound = true;
 
+    for(auto sig: signals){
+        allFound &= assignHandle(sig);
     }
 
-    return !sigNotFound;
+    return allFound;
 }
 
 void FstProcess::reportSignalsNotFound(vector<FstSignal *> &signals)
@@ -131,35 +123,81 @@ void FstProcess::reportSignalsNotFound(vector<FstSignal *> &signals)
     }
 }
 
+// Called for variable length signals.
 void FstProcess::fst_callback2(void *user_callback_data_pointer, uint64_t time, fstHandle sigHandle, const unsigned char *value, uint32_t len)
 {
-    throw runtime_error("callback2 not supported.");
+    FstProcess *fstProc = (FstProcess *)user_callback_data_pointer;
+    fstProc->dispatchValueChange(time, fstProc->dispatchTable[sigHandle], value, len);
 }
 
+// Called for fixed length signals: the length of the value is the one that was recorded 
+// in the hierarchy.
 void FstProcess::fst_callback(void *user_callback_data_pointer, uint64_t time, fstHandle sigHandle, const unsigned char *value)
 {
-    struct FstCallbackInfo *cbInfo = (struct FstCallbackInfo *)user_callback_data_pointer;
-    map<fstHandle,FstSignal *>::iterator it = cbInfo->handle2Signal.find(sigHandle);
+    FstProcess *fstProc = (FstProcess *)user_callback_data_pointer;
+    FstDispatchEntry &entry = fstProc->dispatchTable[sigHandle];
+    fstProc->dispatchValueChange(time, entry, value, entry.length);
+}
+
+void FstProcess::addSink(FstSignal *signal, FstSink sink)
+{
+    if (dispatchTable.empty()){
+        dispatchTable.resize(reader->maxHandle()+1);
+    }
+
+    FstDispatchEntry &entry = dispatchTable[signal->handle];
+    entry.length = signal->length;
+    entry.sinks.push_back(sink);
+
+    reader->setProcessMask(signal->handle);
+}
 
-    cbInfo->valueChangedCB(time, it->second, value, cbInfo->userInfo);
+void FstProcess::addTarget(FstSignal *signal, uint64_t *target)
+{
+    addSink(signal, { target, nullptr, nullptr });
 }
 
-void FstProcess::getValueChanges(
-                    vector<FstSignal *> signals, 
-                    void (*valueChangedCB)(uint64_t time, FstSignal *signal, const unsigned char *value, void *userInfo), 
-                    void *userInfo)
+void FstProcess::addHandler(FstSignal *signal, SignalChangedCB handler, void *userInfo)
 {
-    struct FstCallbackInfo cbInfo;
-    cbInfo.valueChangedCB   = valueChangedCB;
-    cbInfo.userInfo         = userInfo;
+    addSink(signal, { nullptr, handler, userInfo });
+}
 
-    fstReaderClrFacProcessMaskAll(fstCtx);
+void FstProcess::clearSubscriptions()
+{
+    dispatchTable.clear();
 
-    for(auto sig: signals){
-        fstReaderSetFacProcessMask(fstCtx, sig->handle);
-        cbInfo.handle2Signal.insert({sig->handle, sig});
-    }
+    reader->clrProcessMaskAll();
+}
 
-    fstReaderIterBlocks2(fstCtx, FstProcess::fst_callback, FstProcess::fst_callback2, (void *)&cbInfo, NULL); 
+// Walk all value change blocks once and send each value change to all targets and 
+// handlers that subscribed to that signal, in the order in which they were added.
+void FstProcess::processValueChanges()
+{
+    stopped = false;
+
+    reader->iterValueChanges(FstProcess::fst_callback, FstProcess::fst_callback2, (void *)this);
+}
+
+void FstProcess::stopValueChanges()
+{
+    stopped = true;
+
+    // Make the readers return early: the VCD reader at the next time stamp, the FST
+    // library at the next value change block.
+    setTimeRange(0, 0);
+}
+
+void FstProcess::setProgressHandler(ProgressCB handler, void *userInfo, uint64_t interval)
+{
+    progressHandler     = handler;
+    progressUserInfo    = userInfo;
+    progressInterval    = max(interval, (uint64_t)1);
+    nextProgressTime    = handler ? 0 : UINT64_MAX;
+}
+
+void FstProcess::reportProgress(uint64_t time)
+{
+    progressHandler(time, progressUserInfo);
+    nextProgressTime = (time / progressInterval + 1) * progressInterval;
 }
 
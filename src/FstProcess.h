@@ -6,22 +6,32 @@
 #include <regex>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <memory>
+#include <cstring>
 
 #include <fst/fstapi.h>
 
+#include "WaveReader.h"
+
 using namespace std;
 
 class FstSignal
 {
 public:
-    FstSignal() : hasHandle(false) {}
-    FstSignal(string scopeName, string name) : scopeName(scopeName), name(name), hasHandle(false) {}
-    FstSignal(string fullName) : scopeName(getScope(fullName)), name(getLocalName(fullName)), hasHandle(false) {}
+    FstSignal() : hasHandle(false), length(0) {}
+    FstSignal(string scopeName, string name) : scopeName(scopeName), name(name), hasHandle(false), length(0) {}
+    FstSignal(string fullName) : scopeName(getScope(fullName)), name(getLocalName(fullName)), hasHandle(false), length(0) {}
 
     string      scopeName;
     string      name;
     bool        hasHandle;
     fstHandle   handle;
+    uint32_t    length;
+
+    string fullName() const {
+        return scopeName + "." + name;
+    }
 
     static string getScope(string full_path){ 
         int last_dot = full_path.find_last_of('.');
@@ -37,51 +47,185 @@ class FstProcess
 {
 public:
     FstProcess(string fstFileName);
-    ~FstProcess();
 
-    string      version(void)       { return fstReaderGetVersionString(fstCtx); };
+    string      version(void)       { return reader->version(); };
     string      date(void)          { 
-        string d = fstReaderGetDateString(fstCtx);
+        string d = reader->date();
         d = regex_replace(d, regex("^\\s+"), string(""));
         d = regex_replace(d, regex("\\s+$"), string(""));
         return d;
     }
 
-    uint64_t        aliasCount(void)    { return fstReaderGetAliasCount(fstCtx); };
-    uint64_t        startTime(void)     { return fstReaderGetStartTime(fstCtx); };
-    uint64_t        endTime(void)       { return fstReaderGetEndTime(fstCtx); };
-    int64_t         timezero(void)      { return fstReaderGetTimezero(fstCtx); };
-    uint64_t        scopeCount(void)    { return fstReaderGetScopeCount(fstCtx); };
-    int             timescale(void)     { return (int)fstReaderGetTimescale(fstCtx); };
-    uint64_t        varCount(void)      { return fstReaderGetVarCount(fstCtx); };
-    uint64_t        valueChangeSectionCount(void) { return fstReaderGetValueChangeSectionCount(fstCtx); };
+    uint64_t        aliasCount(void)    { return reader->aliasCount(); };
+    uint64_t        startTime(void)     { return reader->startTime(); };
+    uint64_t        endTime(void)       { return reader->endTime(); };
+    int64_t         timezero(void)      { return reader->timezero(); };
+    uint64_t        scopeCount(void)    { return reader->scopeCount(); };
+    int             timescale(void)     { return reader->timescale(); };
+    uint64_t        varCount(void)      { return reader->varCount(); };
+    uint64_t        valueChangeSectionCount(void) { return reader->valueChangeSectionCount(); };
+
+    // Limit processValueChanges() to the blocks that overlap with [start, end]. 
+    // The FST library works at the granularity of value change blocks, so consumers 
+    // will still see changes outside this range: those must only be used to update state.
+    // Use inTimeRange() to decide whether or not to record a value.
+    void            setTimeRange(uint64_t start, uint64_t end);
+    void            clrTimeRange(void);
+    bool            inTimeRange(uint64_t time)  { return !timeRangeValid || (time >= timeRangeStart && time <= timeRangeEnd); };
+    // Returns time, or the first time after the time range when time is past it.
+    uint64_t        clipToTimeRange(uint64_t time) { return timeRangeValid && time > timeRangeEnd ? timeRangeEnd + 1 : time; };
 
     string infoStr(void);
 
+    // Returns true when the simulator has closed the FST file.
+    bool isComplete(void)               { return reader->isComplete(); };
+
+    // List the value change sections that have been completed, in file order. Returns false 
+    // when the sections can't be listed: for VCD files and gzip wrapped FST files.
+    bool valueChangeSections(vector<WaveSection> &sections)    { return reader->valueChangeSections(sections); };
+
+    typedef void (*SignalChangedCB)(uint64_t time, uint64_t value, void *userInfo);
+    typedef void (*ProgressCB)(uint64_t time, void *userInfo);
+
+    // Convert a binary value string of len characters into an integer. Returns false when
+    // the value contains anything other than '0' or '1' (x, z, ...).
+    // 8 characters are checked and converted at a time. Values that are wider than 64 bits
+    // are truncated to the lower 64 bits.
+    static bool decodeBin(const unsigned char *value, uint32_t len, uint64_t *valueInt)
+    {
+        uint64_t result = 0;
+        uint32_t i      = 0;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        for(;i+8<=len;i+=8){
+            uint64_t chars;
+            memcpy(&chars, value+i, 8);
+
+            // All characters must be either '0' (0x30) or '1' (0x31).
+            if ((chars & 0xfefefefefefefefeULL) != 0x3030303030303030ULL)
+                return false;
+
+            // Gather bit 0 of each byte into one byte, first character in the MSB.
+            uint64_t bits = ((chars & 0x0101010101010101ULL) * 0x8040201008040201ULL) >> 56;
+            result = (result << 8) | bits;
+        }
+#endif
+
+        for(;i<len;++i){
+            unsigned char c = value[i];
+            if ((c & 0xfe) != 0x30)
+                return false;
+            result = (result << 1) | (c & 1);
+        }
+
+        *valueInt = result;
+        return true;
+    }
+
+    // Look up the fstHandle of signals. The hierarchy is walked only once, the first time 
+    // a signal needs to be looked up. After that, each lookup is a single hash lookup.
     bool assignHandles(vector<FstSignal *> &signals);
+    bool assignHandle(FstSignal *signal);
     void reportSignalsNotFound(vector<FstSignal *> &signals);
-    void getValueChanges(vector<FstSignal *> signals, void (*valueChangedCB)(uint64_t time, FstSignal *signal, const unsigned char *value, void *userInfo), void *userInfo);
 
-    struct FstCallbackInfo {
-        map<fstHandle,FstSignal *> handle2Signal;
-        void (*valueChangedCB)(uint64_t time, FstSignal *signal, const unsigned char *value, void *userInfo);
-        void *userInfo;
+    // Subscribe to the value changes of a signal. With addTarget, the decoded value is 
+    // stored in *target. With addHandler, handler is called with the decoded value.
+    // Value changes that contain x or z are ignored.
+    // processValueChanges() walks the value change blocks only once for all subscribers.
+    void addTarget(FstSignal *signal, uint64_t *target);
+    void addHandler(FstSignal *signal, SignalChangedCB handler, void *userInfo);
+    void clearSubscriptions();
+    void processValueChanges();
+
+    // Stop sending value changes to targets and handlers for the rest of the current
+    // processValueChanges(). Called from a handler. The VCD reader returns at the next 
+    // time stamp, but the FST library only checks the time range when it starts a value 
+    // change block: the rest of the current block is still decoded, and dropped. 
+    // The time range is lost.
+    void stopValueChanges();
+
+    // Call handler during processValueChanges() each time the value changes have advanced 
+    // by at least interval. It is called before the first value change at time, so all 
+    // value changes before time have been processed.
+    void setProgressHandler(ProgressCB handler, void *userInfo, uint64_t interval);
+
+    struct FstSink {
+        uint64_t *          target;
+        SignalChangedCB     handler;
+        void *              userInfo;
+    };
+
+    // Dispatch table entry for one signal handle.
+    struct FstDispatchEntry {
+        uint32_t            length;
+        vector<FstSink>     sinks;
     };
 
     static void fst_callback2(void *user_callback_data_pointer, uint64_t time, fstHandle txidx, const unsigned char *value, uint32_t len);
     static void fst_callback(void *user_callback_data_pointer, uint64_t time, fstHandle txidx, const unsigned char *value);
 
+    void dispatchValueChange(uint64_t time, FstDispatchEntry &entry, const unsigned char *value, uint32_t len)
+    {
+        if (stopped){
+            return;
+        }
+
+        if (time >= nextProgressTime){
+            reportProgress(time);
+        }
+
+        uint64_t valueInt;
+        if (!decodeBin(value, len, &valueInt)){
+            return;
+        }
+
+        for(auto &sink: entry.sinks){
+            if (sink.target){
+                *sink.target = valueInt;
+            }
+            else{
+                sink.handler(time, valueInt, sink.userInfo);
+            }
+        }
+    }
+
 //private:
-    string  fstFileName;
-    void *  fstCtx;
-    
-public:
-    const vector<string> fileTypeStrings = {
-        "VERILOG",
-        "VHDL",
-        "VERILOG_VHDL"
+    string      fstFileName;
+
+    // An FstReader, or a VcdReader for VCD files.
+    unique_ptr<WaveReader>      reader;
+
+    // Indexed by fstHandle, up to WaveReader::maxHandle()
+    vector<FstDispatchEntry>    dispatchTable;
+
+    void addSink(FstSignal *signal, FstSink sink);
+
+    ProgressCB  progressHandler;
+    void *      progressUserInfo;
+    uint64_t    progressInterval;
+    uint64_t    nextProgressTime;
+
+    void reportProgress(uint64_t time);
+
+    // Set by stopValueChanges().
+    bool        stopped;
+
+    bool        timeRangeValid;
+    uint64_t    timeRangeStart;
+    uint64_t    timeRangeEnd;
+
+    struct FstVar {
+        fstHandle           handle;
+        uint32_t            length;
     };
 
+    // Full path of all variables in the hierarchy
+    bool                            hierIndexValid;
+    unordered_map<string, FstVar>   hierIndex;
+
+    void buildHierIndex();
+    
+public:
     const vector<string> scopeTypeStrings = {
         "VCD_MODULE",
         "VCD_TASK",
@@ -0,0 +1,167 @@
+
+#include <exception>
+#include <sstream>
+#include <fstream>
+
+#include "FstReader.h"
+#include "Logger.h"
+
+static const vector<string> fileTypeStrings = {
+    "VERILOG",
+    "VHDL",
+    "VERILOG_VHDL"
+};
+
+FstReader::FstReader(string fstFileName) :
+    fstFileName(fstFileName)
+{
+    fstCtx = fstReaderOpen(fstFileName.c_str());
+    if (fstCtx == NULL) {
+        stringstream ss;
+        ss << "Could not open file '" << fstFileName << "'";
+        throw runtime_error(ss.str());
+    }
+
+    fstReaderClrFacProcessMaskAll(fstCtx);
+}
+
+FstReader::~FstReader()
+{
+    fstReaderClose(fstCtx);
+}
+
+void FstReader::addInfo(stringstream &ss)
+{
+    const char *    curFlatScope                    = fstReaderGetCurrentFlatScope(fstCtx);
+    int             curScopeLen                     = fstReaderGetCurrentScopeLen(fstCtx);
+    int             doubleEndianMatchState          = fstReaderGetDoubleEndianMatchState(fstCtx);
+    uint64_t        dumpActivityChangeTime          = fstReaderGetDumpActivityChangeTime(fstCtx, 0);
+    unsigned char   dumpActivityChangeValue         = fstReaderGetDumpActivityChangeValue(fstCtx, 0);
+    int             fileType                        = fstReaderGetFileType(fstCtx);
+    int             fseekFailed                     = fstReaderGetFseekFailed(fstCtx);
+    uint64_t        memoryUsedByWriter              = fstReaderGetMemoryUsedByWriter(fstCtx);
+    uint32_t        numDumpActivityChanges          = fstReaderGetNumberDumpActivityChanges(fstCtx);
+
+//    void *          curScopeUserInfo                = fstReaderGetCurrentScopeUserInfo(fstCtx);
+//    fstHandle       maxHandle                       = fstReaderGetMaxHandle(fstCtx);
+//    char *          fstReaderGetValueFromHandleAtTime(fstCtx, uint64_t tim, fstHandle facidx, char *buf);
+//    int             facProcessMask          = fstReaderGetFacProcessMask(fstCtx, fstHandle facidx);
+
+    ss << "curFlatScope: " << curFlatScope << endl;
+    ss << "curScopeLen: " << curScopeLen << endl;
+    ss << "doubleEndianMatchState: " << doubleEndianMatchState << endl;
+    ss << "dumpActivityChangeTime: " << dumpActivityChangeTime << endl;
+    ss << "dumpActivityChangeValue: " << (int)dumpActivityChangeValue << endl;
+    ss << "fileType: " << fileType << " (" << fileTypeStrings[fileType] << ")" << endl;
+    ss << "fseekFailed: " << fseekFailed << endl;
+    ss << "memoryUsedByWriter:" << memoryUsedByWriter << endl;
+    ss << "numDumpActivityChanges: " << numDumpActivityChanges << endl;
+    ss << "timeZero: " << timezero() << endl;
+
+    // FIXME: move...
+    if (numDumpActivityChanges > 0){
+        LOG_ERROR("Blackout regions are not supported.");
+        exit(-2);
+    }
+}
+
+bool FstReader::isComplete()
+{
+    ifstream f(fstFileName, ios::in | ios::binary);
+
+    // Header block: block type, block length, start time, end time.
+    unsigned char hdr[1 + 3 * 8];
+    if (!f.read((char *)hdr, sizeof(hdr))){
+        return false;
+    }
+
+    // Compressed FST files are never written incrementally.
+    if (hdr[0] != FST_BL_HDR){
+        return true;
+    }
+
+    for(int i=9;i<(int)sizeof(hdr);++i){
+        if (hdr[i] != 0)
+            return true;
+    }
+
+    return false;
+}
+
+static uint64_t readUint64BE(const unsigned char *buf)
+{
+    uint64_t value = 0;
+    for(int i=0;i<8;++i){
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+// Walk the blocks of the file: block type, block length (which includes the length
+// itself), block data. A value change block starts with its start and end time.
+// A block that is still being written has the type FST_BL_SKIP.
+bool FstReader::valueChangeSections(vector<WaveSection> &sections)
+{
+    sections.clear();
+
+    ifstream f(fstFileName, ios::in | ios::binary);
+
+    uint64_t pos = 0;
+    for(;;){
+        unsigned char hdr[1 + 3 * 8];
+        f.seekg(pos);
+        if (!f.read((char *)hdr, sizeof(hdr))){
+            break;
+        }
+
+        uint64_t length = readUint64BE(hdr+1);
+        if (hdr[0] == FST_BL_ZWRAPPER){
+            return false;
+        }
+        if (hdr[0] == FST_BL_SKIP || length == 0){
+            break;
+        }
+
+        if (hdr[0] == FST_BL_VCDATA || hdr[0] == FST_BL_VCDATA_DYN_ALIAS || hdr[0] == FST_BL_VCDATA_DYN_ALIAS2){
+            sections.push_back(WaveSection{ readUint64BE(hdr+9), readUint64BE(hdr+17), length });
+        }
+
+        pos += 1 + length;
+    }
+
+    return true;
+}
+
+void FstReader::forEachVar(VarCB cb)
+{
+    struct fstHier *hier;
+    string curScopeName;
+
+    fstReaderIterateHierRewind(fstCtx);
+    while((hier = fstReaderIterateHier(fstCtx))){
+
+        switch(hier->htyp){
+            case FST_HT_SCOPE: {
+                curScopeName = fstReaderPushScope(fstCtx, hier->u.scope.name, NULL);
+                LOG_DEBUG("curScopeName: %s", curScopeName.c_str());
+                break;
+            }
+
+            case FST_HT_UPSCOPE: {
+                curScopeName = fstReaderPopScope(fstCtx);
+                LOG_DEBUG("curScopeName: %s", curScopeName.c_str());
+                break;
+            }
+
+            case FST_HT_VAR: {
+                cb(curScopeName + "." + hier->u.var.name, hier->u.var.handle, hier->u.var.length);
+                break;
+            }
+        }
+    }
+}
+
+void FstReader::iterValueChanges(FixedValueChangeCB fixedCb, ValueChangeCB cb, void *userData)
+{
+    fstReaderIterBlocks2(fstCtx, fixedCb, cb, userData, NULL);
+}
@@ -0,0 +1,51 @@
+#ifndef FST_READER_H
+#define FST_READER_H
+
+#include <fst/fstapi.h>
+
+#include "WaveReader.h"
+
+// Reads FST files with the FST reader library.
+class FstReader : public WaveReader
+{
+public:
+    FstReader(string fstFileName);
+    ~FstReader();
+
+    string      version()                   { return fstReaderGetVersionString(fstCtx); };
+    string      date()                      { return fstReaderGetDateString(fstCtx); };
+    uint64_t    aliasCount()                { return fstReaderGetAliasCount(fstCtx); };
+    uint64_t    startTime()                 { return fstReaderGetStartTime(fstCtx); };
+    uint64_t    endTime()                   { return fstReaderGetEndTime(fstCtx); };
+    int64_t     timezero()                  { return fstReaderGetTimezero(fstCtx); };
+    uint64_t    scopeCount()                { return fstReaderGetScopeCount(fstCtx); };
+    int         timescale()                 { return (int)fstReaderGetTimescale(fstCtx); };
+    uint64_t    varCount()                  { return fstReaderGetVarCount(fstCtx); };
+    uint64_t    valueChangeSectionCount()   { return fstReaderGetValueChangeSectionCount(fstCtx); };
+    uint32_t    maxHandle()                 { return fstReaderGetMaxHandle(fstCtx); };
+
+    void        addInfo(stringstream &ss);
+
+    // The header of an FST file that is still being written has a start and end time of 0.
+    // This is also the case for FST files of simulations that were aborted.
+    bool        isComplete();
+
+    // Not possible for gzip wrapped FST files.
+    bool        valueChangeSections(vector<WaveSection> &sections);
+
+    void        forEachVar(VarCB cb);
+
+    void        setProcessMask(uint32_t handle)                 { fstReaderSetFacProcessMask(fstCtx, handle); };
+    void        clrProcessMaskAll()                             { fstReaderClrFacProcessMaskAll(fstCtx); };
+    void        setLimitTimeRange(uint64_t start, uint64_t end) { fstReaderSetLimitTimeRange(fstCtx, start, end); };
+    void        setUnlimitedTimeRange()                         { fstReaderSetUnlimitedTimeRange(fstCtx); };
+
+    // The FST library only checks the time range when it starts a value change block.
+    void        iterValueChanges(FixedValueChangeCB fixedCb, ValueChangeCB cb, void *userData);
+
+private:
+    string      fstFileName;
+    void *      fstCtx;
+};
+
+#endif
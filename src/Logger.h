@@ -6,6 +6,7 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <mutex>
 
 class Logger
 {
@@ -35,6 +36,7 @@ class Logger
         DebugLevel      debugLevel;
         std::string     logFileName;
         std::ofstream   logFile;
+        std::mutex      logMutex;
 
     public:
         void setDebugLevel(DebugLevel l){
@@ -46,6 +48,8 @@ class Logger
         }
         void out(DebugLevel l, std::string s, bool prefix = true, bool ret = true) {
             if (l <= debugLevel){
+                std::lock_guard<std::mutex> lock(logMutex);
+
                 std::string p_str = "";
                 if (prefix){
                     switch(l){
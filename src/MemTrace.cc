@@ -1,9 +1,12 @@
 
 #include <stdio.h>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <cstring>
 #include <string>
+#include <unordered_set>
 
 using namespace std;
 
@@ -12,6 +15,11 @@ using namespace std;
 
 extern bool verbose;
 
+#define DEFAULT_NR_SNAPSHOTS    64
+
+// More read commands without a response than a data bus can have in flight.
+#define MAX_PENDING_READS       16
+
 MemTrace::MemTrace(FstProcess & fstProc, string memInitFileName, int memInitStartAddr,  
                 FstSignal clk, 
                 FstSignal memCmdValid, FstSignal memCmdReady, FstSignal memCmdAddr, FstSignal memCmdSize, FstSignal memCmdWr, FstSignal memCmdWrData,
@@ -19,6 +27,7 @@ MemTrace::MemTrace(FstProcess & fstProc, string memInitFileName, int memInitStar
     fstProc(fstProc), 
     memInitFileName(memInitFileName),
     memInitStartAddr(memInitStartAddr),
+    memInitLoaded(false),
     clk(clk),
     memCmdValid(memCmdValid),
     memCmdReady(memCmdReady),
@@ -27,112 +36,206 @@ MemTrace::MemTrace(FstProcess & fstProc, string memInitFileName, int memInitStar
     memCmdWr(memCmdWr),
     memCmdWrData(memCmdWrData),
     memRspValid(memRspValid),
-    memRspData(memRspData)
+    memRspData(memRspData),
+    pendingReadsKnown(true),
+    nrIndexedWrites(0),
+    indexedImageChanged(false),
+    nextSnapshotTime(0)
 {
-    init();
+    // In follow mode, this is the duration of what has been written so far.
+    snapshotInterval        = (fstProc.endTime() - fstProc.startTime()) / DEFAULT_NR_SNAPSHOTS;
+    defaultSnapshotInterval = true;
 }
 
-static void memChangedCB(uint64_t time, FstSignal *signal, const unsigned char *value, void *userInfo)
+void MemTrace::updateDuration(uint64_t duration)
 {
-    MemTrace *memTrace = (MemTrace *)userInfo;
-    memTrace->processSignalChanged(time, signal, value);
-}
-
-void MemTrace::processSignalChanged(uint64_t time, FstSignal *signal, const unsigned char *value)
-{
-    if (strstr((char *)value, "x") || strstr((char *)value, "z")){
+    uint64_t interval = duration / DEFAULT_NR_SNAPSHOTS;
+    if (!defaultSnapshotInterval || interval <= snapshotInterval)
         return;
+
+    size_t nrKept = 0;
+    for(size_t i=0;i<snapshots.size();++i){
+        if (nrKept > 0 && snapshots[i].time < snapshots[nrKept-1].time + interval)
+            continue;
+        if (i != nrKept){
+            snapshots[nrKept] = move(snapshots[i]);
+        }
+        ++nrKept;
     }
+    snapshots.erase(snapshots.begin() + nrKept, snapshots.end());
+
+    snapshotInterval = interval;
 
-    uint64_t valueInt = stol(string((const char *)value), nullptr, 2);
+    LOG_INFO("Memory snapshot interval increased to %ld", snapshotInterval);
+}
 
-#if 0
-    LOG_DEBUG("%ld, %ud, %s, %s, %ld", time, signal->handle, signal->name.c_str(), value, valueInt);
-#endif
+static void clkChangedCB(uint64_t time, uint64_t value, void *userInfo)
+{
+    MemTrace *memTrace = (MemTrace *)userInfo;
+    memTrace->clkChanged(time, value);
+}
 
-    if (signal->handle == memCmdValid.handle){
-        curMemCmdValid      = valueInt;
-        return;
-    }
+// All signals changes on the rising edge of the clock. Everything is stable at the falling edge...
+void MemTrace::clkChanged(uint64_t time, uint64_t value)
+{
+    bool fallingEdge = curClkVal == 1 && value == 0;
+    curClkVal = value;
 
-    if (signal->handle == memCmdReady.handle){
-        curMemCmdReady      = valueInt;
-        return;
+    if (fallingEdge){
+        sample(time);
     }
+}
 
-    if (signal->handle == memCmdAddr.handle){
-        curMemCmdAddr       = valueInt;
+void MemTrace::sample(uint64_t time)
+{
+    // The FST library also sends the value changes before and after the time range that 
+    // are in the same value change block. The responses in those cycles belong to the reads
+    // that are pending there, which are only known to the decode of that time range.
+    if (!fstProc.inTimeRange(time))
         return;
-    }
 
-    if (signal->handle == memCmdSize.handle){
-        curMemCmdSize       = valueInt;
+    BusCycle cycle;
+    cycle.time      = time;
+    cycle.cmdAddr   = curMemCmdAddr;
+    cycle.cmdSize   = curMemCmdSize;
+    cycle.cmdWrData = curMemCmdWrData;
+    cycle.rspData   = curMemRspData;
+    cycle.cmd       = curMemCmdValid && curMemCmdReady;
+    cycle.cmdWr     = curMemCmdWr;
+    cycle.rsp       = curMemRspValid;
+
+    if (!cycle.cmd && !cycle.rsp)
         return;
-    }
 
-    if (signal->handle == memCmdWr.handle){
-        curMemCmdWr         = valueInt;
+    if (!pendingReadsKnown){
+        deferredCycles.push_back(cycle);
         return;
     }
 
-    if (signal->handle == memCmdWrData.handle){
-        curMemCmdWrData     = valueInt;
-        return;
+    busCycle(cycle);
+}
+
+void MemTrace::busCycle(const BusCycle &cycle)
+{
+    // Read responses come in the order of the commands, at least one clock cycle later:
+    // a response belongs to the oldest pending read, never to a command at the same edge.
+    if (cycle.rsp && !pendingReads.empty()){
+        PendingRead read = pendingReads.front();
+        pendingReads.pop_front();
+
+        recordAccess(cycle.time, read.addr, read.size, cycle.rspData, false);
     }
 
-    if (signal->handle == memRspValid.handle){
-        curMemRspValid      = valueInt;
-        return;
+    if (cycle.cmd){
+        if (cycle.cmdWr){
+            recordAccess(cycle.time, cycle.cmdAddr, cycle.cmdSize, cycle.cmdWrData, true);
+        }
+        else{
+            pendingReads.push_back(PendingRead{ cycle.cmdAddr, cycle.cmdSize });
+
+            // Without responses, the memRspValid signal is wrong: don't let the queue grow.
+            if (pendingReads.size() > MAX_PENDING_READS){
+                pendingReads.pop_front();
+            }
+        }
     }
+}
 
-    if (signal->handle == memRspData.handle){
-        curMemRspData       = valueInt;
-        return;
+void MemTrace::syncPendingReads(const deque<PendingRead> &reads)
+{
+    pendingReads        = reads;
+    pendingReadsKnown   = true;
+
+    deferredCycles.forEachChunk([this](const BusCycle *cycles, size_t len){
+        for(size_t i=0;i<len;++i){
+            busCycle(cycles[i]);
+        }
+    });
+    deferredCycles.clear();
+}
+
+void MemTrace::recordAccess(uint64_t time, uint64_t addr, uint64_t size, uint64_t data, bool write)
+{
+    int byteEna = 0;
+    switch(size){
+        case 0:  byteEna     = 1 << (addr & 3); break;
+        case 1:  byteEna     = 3 << (addr & 3); break;
+        default: byteEna     = 15; break;
     }
 
-    // All signals changes on the rising edge of the clock. Everything is stable at the falling edge...
-    if (signal->handle == clk.handle && valueInt == 0){
-        if (curMemCmdValid && curMemCmdReady){
-            // For now, only handle memory writes.
-            if (curMemCmdWr){
-                int byteEna = 0;
-                switch(curMemCmdSize){
-                    case 0:  byteEna     = 1 << (curMemCmdAddr & 3); break;
-                    case 1:  byteEna     = 3 << (curMemCmdAddr & 3); break;
-                    default: byteEna     = 15; break;
-                }
+    for(int byteNr=0; byteNr<4;++byteNr){
+        if (byteEna & (1<<byteNr)){
+            uint64_t byteVal    = (data >> (byteNr * 8)) & 255;
+            uint64_t byteAddr   = (addr & ~3) | byteNr;
 
-                for(int byteNr=0; byteNr<4;++byteNr){
-                    if (byteEna & (1<<byteNr)){
-                        uint64_t byteVal    = (curMemCmdWrData >> (byteNr * 8)) & 255;
-                        uint64_t addr       = (curMemCmdAddr & ~3) | byteNr;
+            uint64_t &lastValue = lastValues[byteAddr % NR_LAST_VALUES];
+            if (!write && lastValue == ((byteAddr << 8) | byteVal))
+                continue;
+            lastValue = (byteAddr << 8) | byteVal;
 
-                        if (verbose) LOG_INFO("MemWr: 0x%08lx <- 0x%02lx (@%ld)", addr, byteVal, time);
+            if (verbose) LOG_INFO("%s: 0x%08lx %s 0x%02lx (@%ld)", write ? "MemWr" : "MemRd", byteAddr, write ? "<-" : "->", byteVal, time);
 
-                        MemAccess   ma = { time, curMemCmdWr, addr, byteVal }; 
-                        memTrace.push_back(ma);
-                    }
-                }
-            }
+            MemAccess   ma = { time, byteAddr, byteVal }; 
+            memTrace.push_back(ma);
         }
     }
 }
 
-void MemTrace::init()
+void MemTrace::sampleUntil(uint64_t time)
+{
+    // The falling edges after the time range are sampled when the next time range is 
+    // decoded, with the values of that time.
+    time = fstProc.clipToTimeRange(time);
+
+    if (!(curMemCmdValid && curMemCmdReady) && !(curMemRspValid && (!pendingReads.empty() || !pendingReadsKnown))){
+        clkSampler.skipUntil(time);
+    }
+
+    uint64_t edge;
+    while(clkSampler.nextEdge(time, &edge)){
+        sample(edge);
+    }
+}
+
+void MemTrace::finish(uint64_t endTime)
+{
+    if (clkSampler.enabled()){
+        sampleUntil(endTime+1);
+    }
+}
+
+// Clock-free mode: called before the new value is stored.
+static void signalChangedCB(uint64_t time, uint64_t value, void *userInfo)
 {
+    MemTrace *memTrace = (MemTrace *)userInfo;
+    memTrace->sampleUntil(time);
+}
+
+void MemTrace::loadMemInitFile()
+{
+    memInitLoaded = true;
+
     if (!memInitFileName.empty()){
         LOG_INFO("Loading mem init file: %s", memInitFileName.c_str());
-        ifstream initFile(memInitFileName, ios::in | ios::binary);
+        ifstream initFile(memInitFileName, ios::in | ios::binary | ios::ate);
         if (initFile.fail()){
             LOG_ERROR("Error opening mem init file: %s (%s)", memInitFileName.c_str(), strerror(errno));
             exit(1);
         }
-        memInitContents = vector<char>((std::istreambuf_iterator<char>(initFile)), std::istreambuf_iterator<char>());
+
+        memInitContents.resize(initFile.tellg());
+        initFile.seekg(0);
+        initFile.read(memInitContents.data(), memInitContents.size());
     }
+}
 
+void MemTrace::init()
+{
     vector<FstSignal *> sigs;
 
-    sigs.push_back(&clk);
+    if (!clkSampler.enabled()){
+        sigs.push_back(&clk);
+    }
     sigs.push_back(&memCmdValid);
     sigs.push_back(&memCmdReady);
     sigs.push_back(&memCmdAddr);
@@ -148,45 +251,270 @@ void MemTrace::init()
         exit(-1);
     }
 
-    curMemCmdValid  = false;
-    curMemCmdReady  = false;
+    curClkVal       = 0;
+    curMemCmdValid  = 0;
+    curMemCmdReady  = 0;
     curMemCmdAddr   = 0;
     curMemCmdSize   = 0;
-    curMemCmdWr     = false;
+    curMemCmdWr     = 0;
     curMemCmdWrData = 0;
-    curMemRspValid  = false;
+    curMemRspValid  = 0;
     curMemRspData   = 0;
 
-    fstProc.getValueChanges(sigs, memChangedCB, (void *)this);
+    pendingReads.clear();
+    lastValues.assign(NR_LAST_VALUES, NO_LAST_VALUE);
+
+    if (clkSampler.enabled()){
+        clkSampler.reset();
+        fstProc.addHandler(&memCmdValid,  signalChangedCB, (void *)this);
+        fstProc.addHandler(&memCmdReady,  signalChangedCB, (void *)this);
+        fstProc.addHandler(&memCmdAddr,   signalChangedCB, (void *)this);
+        fstProc.addHandler(&memCmdSize,   signalChangedCB, (void *)this);
+        fstProc.addHandler(&memCmdWr,     signalChangedCB, (void *)this);
+        fstProc.addHandler(&memCmdWrData, signalChangedCB, (void *)this);
+        fstProc.addHandler(&memRspValid,  signalChangedCB, (void *)this);
+        fstProc.addHandler(&memRspData,   signalChangedCB, (void *)this);
+    }
+    else{
+        fstProc.addHandler(&clk, clkChangedCB, (void *)this);
+    }
+    fstProc.addTarget(&memCmdValid,  &curMemCmdValid);
+    fstProc.addTarget(&memCmdReady,  &curMemCmdReady);
+    fstProc.addTarget(&memCmdAddr,   &curMemCmdAddr);
+    fstProc.addTarget(&memCmdSize,   &curMemCmdSize);
+    fstProc.addTarget(&memCmdWr,     &curMemCmdWr);
+    fstProc.addTarget(&memCmdWrData, &curMemCmdWrData);
+    fstProc.addTarget(&memRspValid,  &curMemRspValid);
+    fstProc.addTarget(&memRspData,   &curMemRspData);
+}
 
-    LOG_INFO("Nr mem write transactions: %ld", memTrace.size());
+void MemTrace::append(MemTrace &slice)
+{
+    if (!slice.pendingReadsKnown){
+        slice.syncPendingReads(pendingReads);
+    }
+
+    memTrace.append(slice.memTrace);
+    pendingReads = slice.pendingReads;
+    mergeLastValues(slice);
+    updateIndex();
+}
+void MemTrace::appendLastWrites(const MemTrace &slice)
+{
+    vector<MemAccess>           lastWrites;
+    unordered_set<uint64_t>     addrs;
+
+    for(size_t i=slice.memTrace.size();i-- > 0;){
+        MemAccess m = slice.memTrace[i];
+        if (addrs.insert(m.addr).second){
+            lastWrites.push_back(m);
+        }
+    }
+
+    for(auto it = lastWrites.rbegin(); it != lastWrites.rend(); ++it){
+        memTrace.push_back(*it);
+    }
+    pendingReads = slice.pendingReads;
+    mergeLastValues(slice);
+    updateIndex();
 }
 
+// An entry that the slice didn't fill is for an address that the slice didn't access.
+void MemTrace::mergeLastValues(const MemTrace &slice)
+{
+    lastValues.resize(NR_LAST_VALUES, NO_LAST_VALUE);
+
+    for(size_t i=0;i<slice.lastValues.size();++i){
+        if (slice.lastValues[i] != NO_LAST_VALUE){
+            lastValues[i] = slice.lastValues[i];
+        }
+    }
+}
+
+void MemTrace::clearIndex()
+{
+    memIndex.clear();
+    snapshots.clear();
+    indexedImage.clear();
+    indexedImageChanged = false;
+    nextSnapshotTime    = 0;
+    nrIndexedWrites     = 0;
+}
 
-bool MemTrace::getValue(uint64_t time, uint64_t addr, char *value)
+void MemTrace::updateIndex()
 {
-    bool        valueValid = false;
-    uint64_t    val = 0;
+    // The trace was replaced.
+    if (memTrace.size() < nrIndexedWrites){
+        clearIndex();
+    }
+
+    for(;nrIndexedWrites < memTrace.size();++nrIndexedWrites){
+        MemAccess m = memTrace[nrIndexedWrites];
+
+        unique_ptr<MemIndexPage> &page = memIndex[m.addr / MEM_INDEX_PAGE_SIZE];
+        if (!page){
+            page.reset(new MemIndexPage());
+        }
+
+        size_t pageOffset = m.addr % MEM_INDEX_PAGE_SIZE;
 
-    if (addr >= memInitStartAddr && addr < (memInitStartAddr + memInitContents.size())){
-        valueValid = true;
-        val = memInitContents[addr - memInitStartAddr];
+        page->times.push_back(m.time);
+        page->offsets.push_back(pageOffset);
+        page->values.push_back(m.value);
+
+        if (snapshotInterval == 0)
+            continue;
+
+        // The snapshot only contains the writes before nextSnapshotTime.
+        if (m.time >= nextSnapshotTime){
+            if (indexedImageChanged){
+                MemSnapshot snapshot;
+                snapshot.time = nextSnapshotTime;
+                snapshot.pages.insert(indexedImage.begin(), indexedImage.end());
+                snapshots.push_back(move(snapshot));
+
+                indexedImageChanged = false;
+            }
+            nextSnapshotTime = (m.time / snapshotInterval + 1) * snapshotInterval;
+        }
+
+        shared_ptr<MemSnapshotPage> &imagePage = indexedImage[m.addr / MEM_INDEX_PAGE_SIZE];
+        if (!imagePage){
+            imagePage = make_shared<MemSnapshotPage>();
+        }
+        else if (imagePage.use_count() > 1){
+            imagePage = make_shared<MemSnapshotPage>(*imagePage);
+        }
+
+        imagePage->writtenMask[pageOffset / 64] |= 1ULL << (pageOffset % 64);
+        imagePage->values[pageOffset]            = m.value;
+        indexedImageChanged = true;
     }
+}
 
-    for(auto m: memTrace){
-        if (m.time > time)
-            break;
 
-        if (m.wr && m.addr == addr){
-            valueValid      = true;
-            val             = m.value;
+// A counting sort on the offsets: the writes to each offset stay in time order.
+void MemIndexPage::sortByOffset()
+{
+    nrSorted = times.size();
+
+    uint32_t counts[MEM_INDEX_PAGE_SIZE] = {};
+    offsets.forEachChunk([&](const uint8_t *o, size_t len){
+        for(size_t i=0;i<len;++i){
+            ++counts[o[i]];
         }
+    });
+
+    offsetStarts[0] = 0;
+    for(int offset=0;offset<MEM_INDEX_PAGE_SIZE;++offset){
+        offsetStarts[offset+1] = offsetStarts[offset] + counts[offset];
     }
 
-    *value      = val;
+    vector<uint32_t> sorted(nrSorted);
+    uint32_t pos = 0;
+    offsets.forEachChunk([&](const uint8_t *o, size_t len){
+        for(size_t i=0;i<len;++i,++pos){
+            sorted[offsetStarts[o[i]+1] - counts[o[i]]--] = pos;
+        }
+    });
 
-    return valueValid;
+    byOffset.clear();
+    byOffset.append(sorted.data(), sorted.size());
 }
 
+void MemTrace::getRange(uint64_t time, uint64_t addr, size_t len, char *out)
+{
+    if (!memInitLoaded){
+        loadMemInitFile();
+    }
+
+    updateIndex();
+
+    uint64_t initEnd = memInitStartAddr + memInitContents.size();
+
+    // The snapshot after the last one at or before time.
+    auto snapshotIt = upper_bound(snapshots.begin(), snapshots.end(), time, 
+                                  [](uint64_t time, const MemSnapshot &s){ return time < s.time; });
+
+    // One page at a time.
+    for(size_t pos=0;pos<len;){
+        uint64_t    chunkAddr   = addr + pos;
+        size_t      pageOffset  = chunkAddr % MEM_INDEX_PAGE_SIZE;
+        size_t      chunkLen    = min(len - pos, MEM_INDEX_PAGE_SIZE - pageOffset);
+        char *      chunk       = out + pos;
+
+        memset(chunk, 0, chunkLen);
+
+        uint64_t initStart  = max(chunkAddr, (uint64_t)memInitStartAddr);
+        uint64_t initStop   = min(chunkAddr + chunkLen, initEnd);
+        if (initStart < initStop){
+            memcpy(chunk + (initStart - chunkAddr), &memInitContents[initStart - memInitStartAddr], initStop - initStart);
+        }
+
+        uint64_t pageNr = chunkAddr / MEM_INDEX_PAGE_SIZE;
+
+        auto pageIt = memIndex.find(pageNr);
+        if (pageIt != memIndex.end()){
+            MemIndexPage &page = *pageIt->second;
+
+            // The writes to the page up to time, and the ones since the last snapshot.
+            size_t nrWrites = upper_bound(page.times.begin(), page.times.end(), time) - page.times.begin();
+            size_t writeNr  = 0;
+
+            const MemSnapshotPage *snapshotPage = nullptr;
+            if (snapshotIt != snapshots.begin()){
+                const MemSnapshot &snapshot = *(snapshotIt-1);
+
+                auto snapshotPageIt = snapshot.pages.find(pageNr);
+                if (snapshotPageIt != snapshot.pages.end()){
+                    snapshotPage = snapshotPageIt->second.get();
+                }
+
+                writeNr = lower_bound(page.times.begin(), page.times.begin() + nrWrites, snapshot.time) - page.times.begin();
+            }
+
+            // Replaying the writes since the snapshot looks at each of them once. Looking 
+            // each byte up in its own history takes a binary search per byte instead.
+            size_t searchCost = chunkLen * (64 - __builtin_clzll(nrWrites | 1));
+
+            if (nrWrites - writeNr <= searchCost){
+                // Start from the page in the last snapshot before time, if any...
+                if (snapshotPage){
+                    for(size_t i=0;i<chunkLen;++i){
+                        size_t offset = pageOffset + i;
+                        if (snapshotPage->writtenMask[offset / 64] & (1ULL << (offset % 64))){
+                            chunk[i] = snapshotPage->values[offset];
+                        }
+                    }
+                }
 
+                // ... and replay the writes to the page since.
+                for(;writeNr < nrWrites;++writeNr){
+                    size_t offset = page.offsets[writeNr];
+                    if (offset >= pageOffset && offset < pageOffset + chunkLen){
+                        chunk[offset - pageOffset] = page.values[writeNr];
+                    }
+                }
+            }
+            else{
+                if (page.nrSorted < nrWrites){
+                    page.sortByOffset();
+                }
 
+                // The last write to each byte before nrWrites.
+                for(size_t i=0;i<chunkLen;++i){
+                    size_t offset = pageOffset + i;
+                    auto historyStart   = page.byOffset.begin() + page.offsetStarts[offset];
+                    auto historyEnd     = page.byOffset.begin() + page.offsetStarts[offset+1];
+
+                    auto it = lower_bound(historyStart, historyEnd, (uint32_t)nrWrites);
+                    if (it != historyStart){
+                        chunk[i] = page.values[*(it-1)];
+                    }
+                }
+            }
+        }
+
+        pos += chunkLen;
+    }
+}
@@ -3,17 +3,98 @@
 
 #include <stdint.h>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
 
 #include <FstProcess.h>
+#include <ClkSampler.h>
+#include <TraceColumn.h>
 
 struct MemAccess
 {
     uint64_t    time;
-    bool        wr;
     uint64_t    addr;
     uint64_t    value;
 };
 
+// The memory byte writes, stored as one column per field. The bytes returned by a read are
+// stored as writes of the value that was observed.
+class MemWrites
+{
+public:
+    TraceColumn<uint64_t>   times;
+    TraceColumn<uint32_t>   addrs;
+    TraceColumn<uint8_t>    values;
+
+    size_t size() const                     { return times.size(); }
+    MemAccess operator[](size_t idx) const  { return MemAccess{ times[idx], addrs[idx], values[idx] }; }
+
+    void push_back(const MemAccess &access)
+    {
+        times.push_back(access.time);
+        addrs.push_back(access.addr);
+        values.push_back(access.value);
+    }
+
+    // Move the writes to the end of these. writes is left empty.
+    void append(MemWrites &writes)
+    {
+        times.append(move(writes.times));
+        addrs.append(move(writes.addrs));
+        values.append(move(writes.values));
+    }
+
+    void clear()
+    {
+        times.clear();
+        addrs.clear();
+        values.clear();
+    }
+};
+
+#define MEM_INDEX_PAGE_SIZE     256
+
+#define NR_LAST_VALUES          4096
+#define NO_LAST_VALUE           UINT64_MAX
+
+// The writes to a page of memory, in time order.
+//
+// When the page is read, the positions of its writes are also sorted by offset: 
+// byOffset[offsetStarts[offset]] up to byOffset[offsetStarts[offset+1]] is the history of 
+// the byte at offset, in time order. Only the first nrSorted writes are in there: they are 
+// sorted again when a read needs the writes that were added since.
+struct MemIndexPage
+{
+    MemIndexPage() : nrSorted(0) {}
+
+    TraceColumn<uint64_t>   times;
+    TraceColumn<uint8_t>    offsets;
+    TraceColumn<uint8_t>    values;
+
+    TraceColumn<uint32_t>   byOffset;
+    uint32_t                offsetStarts[MEM_INDEX_PAGE_SIZE + 1];
+    size_t                  nrSorted;
+
+    void sortByOffset();
+};
+
+// The contents of a page of memory. Bytes that haven't been written have their bit 
+// cleared in writtenMask.
+struct MemSnapshotPage
+{
+    uint64_t    writtenMask[MEM_INDEX_PAGE_SIZE / 64];
+    uint8_t     values[MEM_INDEX_PAGE_SIZE];
+};
+
+// The pages of memory that were written before time. Pages that didn't change between 
+// snapshots are shared.
+struct MemSnapshot
+{
+    uint64_t                                                    time;
+    unordered_map<uint64_t, shared_ptr<const MemSnapshotPage>>  pages;
+};
+
 class MemTrace
 {
 public:
@@ -22,8 +103,20 @@ public:
                 FstSignal memCmdValid, FstSignal memCmdReady, FstSignal memCmdAddr, FstSignal memCmdSize, FstSignal memCmdWr, FstSignal memCmdWrData,
                 FstSignal memRspValid, FstSignal memRspData);
 
+    // Look up the signals in the FST file and subscribe to their value changes.
+    // Must be called before FstProcess::processValueChanges().
     void init();
 
+    // Only called when the memory contents are first needed.
+    void loadMemInitFile();
+
+    // Move the memory writes of a trace that was extracted for a later time range to the
+    // end of this one. The slice is left empty.
+    void append(MemTrace &slice);
+
+    // Only add the last write to each address of a trace that was extracted for an earlier time range.
+    void appendLastWrites(const MemTrace &slice);
+
     //void findNextMemAccess(uint64_t startTime, uint64_t pc_value);
 
     // Object to manage access to FST file
@@ -33,6 +126,7 @@ public:
     string              memInitFileName;
     unsigned int        memInitStartAddr;
     std::vector<char>   memInitContents;
+    bool                memInitLoaded;
 
     // Handles to signals inside the FST file
     FstSignal       clk;
@@ -45,24 +139,116 @@ public:
     FstSignal       memRspValid; 
     FstSignal       memRspData;
 
+    // When enabled, the clock signal isn't decoded.
+    ClkSampler      clkSampler;
+
     // Helper signals for the FST callbacks to extract the PC values
-    bool            curMemCmdValid; 
-    bool            curMemCmdReady; 
+    uint64_t        curClkVal;
+    uint64_t        curMemCmdValid; 
+    uint64_t        curMemCmdReady; 
     uint64_t        curMemCmdAddr; 
     uint64_t        curMemCmdSize; 
-    bool            curMemCmdWr; 
+    uint64_t        curMemCmdWr; 
     uint64_t        curMemCmdWrData;
-    bool            curMemRspValid; 
+    uint64_t        curMemRspValid; 
     uint64_t        curMemRspData;
 
-    // All PC values in the FST trace
-    vector<MemAccess>   memTrace;
+    // The read commands that haven't had a response yet, oldest first.
+    struct PendingRead {
+        uint64_t    addr;
+        uint64_t    size;
+    };
+
+    deque<PendingRead>  pendingReads;
+
+    // A clock cycle in which the memory bus had a command, a read response or both.
+    struct BusCycle {
+        uint64_t    time;
+        uint64_t    cmdAddr;
+        uint64_t    cmdSize;
+        uint64_t    cmdWrData;
+        uint64_t    rspData;
+        bool        cmd;
+        bool        cmdWr;
+        bool        rsp;
+    };
+
+    // A slice of a decode only knows which reads are pending at its start once the slices 
+    // before it have been decoded. Until then, its bus cycles are kept in deferredCycles. 
+    // append() replays them with the pending reads of the trace that the slice is added to.
+    bool                    pendingReadsKnown;
+    TraceColumn<BusCycle>   deferredCycles;
+
+    void syncPendingReads(const deque<PendingRead> &reads);
+
+    // The last value recorded for recently accessed addresses, so that reads that return 
+    // the value that is already known aren't recorded. Direct mapped on the low address 
+    // bits: an evicted address only costs a redundant read record, never a wrong value.
+    // Each entry is the byte address shifted left by 8, or'ed with the value.
+    vector<uint64_t>    lastValues;
+
+    // Take over the entries of a trace that was extracted for a later time range.
+    void mergeLastValues(const MemTrace &slice);
+
+    // All memory byte writes in the FST trace, and the bytes returned by reads
+    MemWrites           memTrace;
+
+    // The write history of each written page, so that the bytes of a page at a given time 
+    // can be found with a hash lookup, and either a replay of the writes since the last 
+    // snapshot or a binary search in the history of each byte, whichever is shorter.
+    unordered_map<uint64_t, unique_ptr<MemIndexPage>>  memIndex;
+
+    // Number of records of memTrace that have been added to memIndex.
+    size_t              nrIndexedWrites;
+
+    // A snapshot of the written memory every snapshotInterval, so that a page can be 
+    // rebuilt from the last snapshot before a time and the writes to the page since.
+    // Defaults to a fraction of the duration of the trace. 0 disables the snapshots.
+    vector<MemSnapshot> snapshots;
+    uint64_t            snapshotInterval;
+    bool                defaultSnapshotInterval;
+
+    // The trace now lasts duration, because a followed FST file has grown. With the default
+    // interval, increase the interval and drop the snapshots that are closer together than 
+    // that, so that the number of snapshots stays the same as the trace grows.
+    void updateDuration(uint64_t duration);
+
+    // The written memory after the indexed writes. Its pages are copied when they are 
+    // written while a snapshot still uses them.
+    unordered_map<uint64_t, shared_ptr<MemSnapshotPage>>    indexedImage;
+    bool                indexedImageChanged;
+    uint64_t            nextSnapshotTime;
+
+    // Add the records that were added to memTrace since the last call to memIndex and 
+    // the snapshots.
+    void updateIndex();
+
+    // Drop memIndex and the snapshots, to index memTrace from the start again.
+    void clearIndex();
+
+    void clkChanged(uint64_t time, uint64_t value);
+
+    // Record the memory write or read response, if any, at the falling edge of the clock at time.
+    // Only the clock cycles in the time range are sampled: the decode of the time range before
+    // or after samples the others.
+    void sample(uint64_t time);
+
+    // Pair the read responses with the pending reads, and record the accesses of cycle.
+    void busCycle(const BusCycle &cycle);
+
+    // Record the bytes of a bus word that were accessed by a command of size at addr.
+    void recordAccess(uint64_t time, uint64_t addr, uint64_t size, uint64_t data, bool write);
 
-    vector<MemAccess>::iterator memTraceIt;
+    // Clock-free mode: sample all falling edges before time. Called before a value change.
+    void sampleUntil(uint64_t time);
 
-    void processSignalChanged(uint64_t time, FstSignal *signal, const unsigned char *value);
+    // Clock-free mode: sample the falling edges after the last value change, up to endTime.
+    // Must be called after FstProcess::processValueChanges().
+    void finish(uint64_t endTime);
 
-    bool getValue(uint64_t time, uint64_t addr, char *value);
+    // Get the len bytes starting at addr at time. Bytes that haven't been written by then 
+    // come from the init image, or are 0 outside of it.
+    void getRange(uint64_t time, uint64_t addr, size_t len, char *out);
 };
 
 #endif
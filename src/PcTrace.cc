@@ -0,0 +1,263 @@
+#include "PcTrace.h"
+
+#define PC_TRACE_BLOCK_SIZE     256
+
+// Instructions are usually 4 bytes.
+#define PC_STEP                 4
+
+static inline void putVarint(TraceColumn<uint8_t> &bytes, int64_t value)
+{
+    // Zigzag encoding: small negative values are small too.
+    uint64_t v = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+
+    while(v >= 0x80){
+        bytes.push_back((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    bytes.push_back(v);
+}
+
+PcTrace::PcTrace() :
+    branchMode(false),
+    codeImage(nullptr),
+    codeImageStart(0),
+    nrValues(0),
+    lastValue{ 0, 0 },
+    lastTimeStep(0),
+    blockFill(0),
+    lastBranchPos(0),
+    lookupCursor(*this)
+{
+}
+
+void PcTrace::setBranchMode(const vector<char> *codeImage, uint64_t codeImageStart)
+{
+    this->branchMode        = true;
+    this->codeImage         = codeImage;
+    this->codeImageStart    = codeImageStart;
+}
+
+void PcTrace::push_back(const PcValue &value)
+{
+    if (blockFill == 0 || blockFill == PC_TRACE_BLOCK_SIZE){
+        blocks.push_back(Block{ nrValues, bytes.size(), value.time, value.pc, branchBytes.size() });
+        lastTimeStep    = 0;
+        blockFill       = 0;
+        lastBranchPos   = 0;
+    }
+    else{
+        if (!branchMode){
+            putVarint(bytes, (int64_t)(value.pc - lastValue.pc) - PC_STEP);
+        }
+        else{
+            uint64_t expectedPc = lastValue.pc + instrLength(lastValue.pc);
+            if (value.pc != expectedPc){
+                putVarint(branchBytes, blockFill - lastBranchPos);
+                putVarint(branchBytes, (int64_t)(value.pc - expectedPc));
+                lastBranchPos = blockFill;
+            }
+        }
+
+        int64_t timeStep = value.time - lastValue.time;
+        putVarint(bytes, timeStep - lastTimeStep);
+        lastTimeStep = timeStep;
+    }
+
+    lastValue = value;
+    ++blockFill;
+    ++nrValues;
+}
+
+void PcTrace::append(PcTrace &trace)
+{
+    if (trace.size() == 0)
+        return;
+
+    // The blocks of trace start where the columns of this trace end.
+    for(size_t i=0;i<trace.blocks.size();++i){
+        Block &block        = trace.blocks[i];
+        block.firstIdx     += nrValues;
+        block.offset       += bytes.size();
+        block.firstBranch  += branchBytes.size();
+    }
+
+    blocks.append(move(trace.blocks));
+    bytes.append(move(trace.bytes));
+    branchBytes.append(move(trace.branchBytes));
+    nrValues += trace.nrValues;
+
+    // The last block of trace is the one that grows now.
+    lastValue       = trace.lastValue;
+    lastTimeStep    = trace.lastTimeStep;
+    blockFill       = trace.blockFill;
+    lastBranchPos   = trace.lastBranchPos;
+
+    // trace continues with a new block. Its columns keep the chunk size they have reached.
+    trace.nrValues      = 0;
+    trace.lastTimeStep  = 0;
+    trace.blockFill     = 0;
+    trace.lastBranchPos = 0;
+    trace.lookupCursor.reset();
+}
+
+void PcTrace::clear()
+{
+    blocks.clear();
+    bytes.clear();
+    branchBytes.clear();
+    nrValues        = 0;
+    lastTimeStep    = 0;
+    blockFill       = 0;
+    lastBranchPos   = 0;
+    lookupCursor.reset();
+}
+
+void PcTrace::restoreEncoder()
+{
+    nrValues            = 0;
+    blockFill           = 0;
+    lookupCursor.reset();
+
+    if (blocks.empty())
+        return;
+
+    // Decode the last block to the end.
+    const Block &lastBlock = blocks[blocks.size()-1];
+    nrValues = lastBlock.firstIdx + 1;
+
+    Cursor cursor(*this);
+    cursor.seek(nrValues-1);
+    while(cursor.offset < bytes.size()){
+        cursor.next();
+        ++nrValues;
+    }
+
+    lastValue       = cursor.value;
+    lastTimeStep    = cursor.timeStep;
+    blockFill       = nrValues - lastBlock.firstIdx;
+    lastBranchPos   = cursor.branchBase - lastBlock.firstIdx;
+}
+
+PcValue PcTrace::operator[](size_t idx) const
+{
+    lookupCursor.seek(idx);
+    return lookupCursor.value;
+}
+
+void PcTrace::Cursor::reset()
+{
+    idx             = SIZE_MAX;
+    bytesSpan       = Span{ nullptr, 0, 0 };
+    branchBytesSpan = Span{ nullptr, 0, 0 };
+}
+
+void PcTrace::Cursor::seek(size_t newIdx)
+{
+    // Continue from the current position when it's earlier in the same block.
+    if (idx != SIZE_MAX && nextBlockIdx == SIZE_MAX && blockNr+1 < trace.blocks.size()){
+        nextBlockIdx = trace.blocks[blockNr+1].firstIdx;
+    }
+
+    if (idx != SIZE_MAX && newIdx >= idx && newIdx < nextBlockIdx){
+        while(idx < newIdx){
+            next();
+        }
+        return;
+    }
+
+    size_t newBlockNr = upper_bound(trace.blocks.begin(), trace.blocks.end(), newIdx, 
+                                    [](size_t idx, const Block &block){ return idx < block.firstIdx; }) - trace.blocks.begin() - 1;
+    startBlock(newBlockNr);
+
+    while(idx < newIdx){
+        next();
+    }
+}
+
+void PcTrace::Cursor::next()
+{
+    ++idx;
+
+    // Blocks may have been added after the last one since.
+    if (nextBlockIdx == SIZE_MAX && blockNr+1 < trace.blocks.size()){
+        nextBlockIdx = trace.blocks[blockNr+1].firstIdx;
+    }
+
+    if (idx == nextBlockIdx){
+        startBlock(blockNr+1);
+        return;
+    }
+
+    if (!trace.branchMode){
+        value.pc    += PC_STEP + getVarint(trace.bytes, bytesSpan, offset);
+    }
+    else{
+        value.pc    += trace.instrLength(value.pc);
+
+        // Branches may have been added to the last block since.
+        if (nextBranchIdx == SIZE_MAX){
+            loadNextBranch();
+        }
+
+        if (idx == nextBranchIdx){
+            value.pc        += getVarint(trace.branchBytes, branchBytesSpan, branchOffset);
+            branchBase      = idx;
+            loadNextBranch();
+        }
+    }
+
+    timeStep   += getVarint(trace.bytes, bytesSpan, offset);
+    value.time += timeStep;
+}
+
+void PcTrace::Cursor::startBlock(size_t newBlockNr)
+{
+    const Block &block = trace.blocks[newBlockNr];
+
+    blockNr         = newBlockNr;
+    nextBlockIdx    = blockNr+1 < trace.blocks.size() ? trace.blocks[blockNr+1].firstIdx : SIZE_MAX;
+
+    idx         = block.firstIdx;
+    value       = PcValue{ block.firstTime, block.firstPc };
+    offset      = block.offset;
+    timeStep    = 0;
+
+    branchOffset    = block.firstBranch;
+    branchBase      = idx;
+    loadNextBranch();
+}
+
+void PcTrace::Cursor::loadNextBranch()
+{
+    // The branches of the block end where those of the next block start.
+    size_t branchesEnd  = blockNr+1 < trace.blocks.size() ? trace.blocks[blockNr+1].firstBranch : trace.branchBytes.size();
+
+    if (branchOffset >= branchesEnd){
+        nextBranchIdx = SIZE_MAX;
+        return;
+    }
+
+    nextBranchIdx   = branchBase + getVarint(trace.branchBytes, branchBytesSpan, branchOffset);
+}
+
+// Decode the varint at offset and move offset past it. The chunk of the column that holds 
+// offset is kept in span, for the next bytes.
+int64_t PcTrace::Cursor::getVarint(const TraceColumn<uint8_t> &column, Span &span, size_t &offset)
+{
+    uint64_t v = 0;
+    int shift = 0;
+
+    for(;;){
+        if (offset < span.start || offset >= span.end){
+            span.values = column.chunkOf(offset, &span.start, &span.end);
+        }
+
+        uint8_t byte = span.values[offset++ - span.start];
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+        shift += 7;
+    }
+
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
@@ -0,0 +1,143 @@
+#ifndef PC_TRACE_H
+#define PC_TRACE_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "TraceColumn.h"
+
+using namespace std;
+
+struct PcValue
+{
+    uint64_t    time;
+    uint64_t    pc;
+};
+
+// The PC values of the retired instructions, compressed in blocks of up to PC_TRACE_BLOCK_SIZE
+// instructions. The first instruction of a block is stored in the block index. The others
+// are stored as varints of the difference with the expected value: the previous PC + 4, 
+// and the previous time + the previous time step. Those are almost always 1 byte each.
+//
+// In branch mode, only the PCs of the instructions that don't directly follow the previous
+// instruction are stored, as branches: varints of the distance in instructions to the
+// previous branch of the block, and of the difference with the PC that was expected. The 
+// other PCs are rebuilt from the length of the previous instruction in the code image. 
+// Only the time steps are stored for each instruction.
+//
+// A cursor decodes the instructions of a block sequentially. Looking up instructions in 
+// order with operator[] continues from the previous lookup.
+//
+// Blocks only depend on their own bytes, so the blocks of a trace that was extracted for a
+// later time range are moved to the end of the trace as they are: the last block before
+// them may be partial.
+class PcTrace
+{
+public:
+    PcTrace();
+
+    struct Block {
+        uint64_t    firstIdx;
+        uint64_t    offset;
+        uint64_t    firstTime;
+        uint64_t    firstPc;
+        uint64_t    firstBranch;
+    };
+
+    class Cursor
+    {
+    public:
+        Cursor(const PcTrace &trace) : trace(trace) { reset(); }
+
+        // Forget the position and the cached chunks, after the columns of the trace changed.
+        void reset();
+
+        // Move to instruction idx, which must exist.
+        void seek(size_t idx);
+
+        // Move to the next instruction, which must exist.
+        void next();
+
+        const PcTrace & trace;
+        size_t          idx;
+        PcValue         value;
+
+    private:
+        friend class PcTrace;
+
+        // The block of idx, and the index of the first instruction of the next block. That's
+        // SIZE_MAX for the last block, until another block is added.
+        size_t          blockNr;
+        size_t          nextBlockIdx;
+
+        size_t          offset;
+        int64_t         timeStep;
+
+        // Branch mode: the next branch, which is the first one after branchBase.
+        size_t          branchOffset;
+        size_t          branchBase;
+        size_t          nextBranchIdx;
+
+        // The chunks of the columns that were read last.
+        struct Span {
+            const uint8_t * values;
+            size_t          start;
+            size_t          end;
+        };
+        Span            bytesSpan;
+        Span            branchBytesSpan;
+
+        void startBlock(size_t blockNr);
+        void loadNextBranch();
+        int64_t getVarint(const TraceColumn<uint8_t> &column, Span &span, size_t &offset);
+    };
+
+    // Must be called before any value is added. The code image, with the contents of memory
+    // from startAddr on, must stay valid as long as the trace.
+    void setBranchMode(const vector<char> *codeImage, uint64_t codeImageStart);
+
+    // Length of the instruction at pc: 2 bytes for a RISC-V compressed instruction, 
+    // 4 bytes otherwise, and when the PC isn't in the code image.
+    unsigned instrLength(uint64_t pc) const
+    {
+        if (codeImage && pc >= codeImageStart && pc - codeImageStart < codeImage->size()){
+            return ((*codeImage)[pc - codeImageStart] & 3) != 3 ? 2 : 4;
+        }
+        return 4;
+    }
+
+    size_t size() const                 { return nrValues; }
+    PcValue operator[](size_t idx) const;
+
+    void push_back(const PcValue &value);
+
+    // Move the values of trace to the end of this one. trace is left empty.
+    void append(PcTrace &trace);
+    void clear();
+
+    // Rebuild the state to add more values after blocks and bytes have been loaded.
+    void restoreEncoder();
+
+    TraceColumn<Block>      blocks;
+    TraceColumn<uint8_t>    bytes;
+
+    bool                branchMode;
+    const vector<char> *codeImage;
+    uint64_t            codeImageStart;
+    TraceColumn<uint8_t>    branchBytes;
+
+private:
+    size_t              nrValues;
+
+    // The last value that was added, to encode the next one. blockFill is the number of 
+    // values in the last block, and lastBranchPos the position in that block of the last
+    // branch, or 0.
+    PcValue             lastValue;
+    int64_t             lastTimeStep;
+    size_t              blockFill;
+    size_t              lastBranchPos;
+
+    mutable Cursor      lookupCursor;
+};
+
+#endif
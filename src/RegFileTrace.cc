@@ -1,8 +1,10 @@
 
 #include <stdio.h>
 
+#include <algorithm>
 #include <iostream>
 #include <string>
+#include <unordered_set>
 
 using namespace std;
 
@@ -11,61 +13,82 @@ using namespace std;
 
 extern bool verbose;
 
+#define DEFAULT_CHECKPOINT_INTERVAL     1024
+#define DEFAULT_CHECKPOINT_MEM_BUDGET   (64 << 20)
+
 RegFileTrace::RegFileTrace(FstProcess & fstProc, FstSignal clk, FstSignal memWr, FstSignal memAddr, FstSignal memWrData) :
     fstProc(fstProc), 
     clk(clk),
     memWr(memWr),
     memAddr(memAddr),
-    memWrData(memWrData)
+    memWrData(memWrData),
+    nrIndexedWrites(0),
+    checkpointInterval(DEFAULT_CHECKPOINT_INTERVAL),
+    checkpointMemBudget(DEFAULT_CHECKPOINT_MEM_BUDGET)
 {
-    init();
+    indexedState = RegFileState();
 }
 
-static void memChangedCB(uint64_t time, FstSignal *signal, const unsigned char *value, void *userInfo)
+void RegFileTrace::sample(uint64_t time)
 {
-    RegFileTrace *regFileTrace = (RegFileTrace *)userInfo;
+    if (curMemWr && fstProc.inTimeRange(time)){
+        if (verbose) LOG_INFO("RegWr: 0x%08lx <- 0x%08lx (@%ld)", curMemAddr, curMemWrData, time);
 
-    if (strstr((char *)value, "x") || strstr((char *)value, "z")){
-        return;
+        RegFileAccess   mem = { time, curMemAddr, curMemWrData };
+        regFileTrace.push_back(mem);
     }
+}
 
-    uint64_t valueInt = stol(string((const char *)value), nullptr, 2);
+// All signals changes on the rising edge of the clock. Everything is stable at the falling edge...
+static void clkChangedCB(uint64_t time, uint64_t value, void *userInfo)
+{
+    RegFileTrace *regFileTrace = (RegFileTrace *)userInfo;
 
-#if 0
-    LOG_DEBUG("%ld, %ud, %s, %s, %ld", time, signal->handle, signal->name.c_str(), value, valueInt);
-#endif
+    bool fallingEdge = regFileTrace->curClkVal == 1 && value == 0;
+    regFileTrace->curClkVal = value;
 
-    if (signal->handle == regFileTrace->memWr.handle){
-        regFileTrace->curMemWr      = valueInt;
-        return;
+    if (fallingEdge){
+        regFileTrace->sample(time);
     }
+}
 
-    if (signal->handle == regFileTrace->memAddr.handle){
-        regFileTrace->curMemAddr    = valueInt;
-        return;
-    }
+void RegFileTrace::sampleUntil(uint64_t time)
+{
+    // The falling edges after the time range are sampled when the next time range is 
+    // decoded, with the values of that time.
+    time = fstProc.clipToTimeRange(time);
 
-    if (signal->handle == regFileTrace->memWrData.handle){
-        regFileTrace->curMemWrData  = valueInt;
-        return;
+    if (!curMemWr){
+        clkSampler.skipUntil(time);
     }
 
-    // All signals changes on the rising edge of the clock. Everything is stable at the falling edge...
-    if (signal->handle == regFileTrace->clk.handle && valueInt == 0){
-        if (regFileTrace->curMemWr){
-            if (verbose) LOG_INFO("RegWr: 0x%08lx <- 0x%08lx (@%ld)", regFileTrace->curMemAddr, regFileTrace->curMemWrData, time);
+    uint64_t edge;
+    while(clkSampler.nextEdge(time, &edge)){
+        sample(edge);
+    }
+}
 
-            RegFileAccess   mem = { time, regFileTrace->curMemWr, regFileTrace->curMemAddr, regFileTrace->curMemWrData };
-            regFileTrace->regFileTrace.push_back(mem);
-        }
+void RegFileTrace::finish(uint64_t endTime)
+{
+    if (clkSampler.enabled()){
+        sampleUntil(endTime+1);
     }
 }
 
+// Clock-free mode: called before the new value is stored.
+static void signalChangedCB(uint64_t time, uint64_t value, void *userInfo)
+{
+    RegFileTrace *regFileTrace = (RegFileTrace *)userInfo;
+    regFileTrace->sampleUntil(time);
+}
+
 void RegFileTrace::init()
 {
     vector<FstSignal *> sigs;
 
-    sigs.push_back(&clk);
+    if (!clkSampler.enabled()){
+        sigs.push_back(&clk);
+    }
     sigs.push_back(&memWr);
     sigs.push_back(&memAddr);
     sigs.push_back(&memWrData);
@@ -76,36 +99,139 @@ void RegFileTrace::init()
         exit(-1);
     }
 
-    curMemWr        = false;
+    curClkVal       = 0;
+    curMemWr        = 0;
     curMemAddr      = 0;
     curMemWrData    = 0;
 
-    fstProc.getValueChanges(sigs, memChangedCB, (void *)this);
+    if (clkSampler.enabled()){
+        clkSampler.reset();
+        fstProc.addHandler(&memWr, signalChangedCB, (void *)this);
+        fstProc.addHandler(&memAddr, signalChangedCB, (void *)this);
+        fstProc.addHandler(&memWrData, signalChangedCB, (void *)this);
+    }
+    else{
+        fstProc.addHandler(&clk, clkChangedCB, (void *)this);
+    }
+    fstProc.addTarget(&memWr, &curMemWr);
+    fstProc.addTarget(&memAddr, &curMemAddr);
+    fstProc.addTarget(&memWrData, &curMemWrData);
+}
 
-    LOG_INFO("Nr regfile write transactions: %ld", regFileTrace.size());
+void RegFileTrace::append(RegFileTrace &slice)
+{
+    regFileTrace.append(slice.regFileTrace);
+    updateIndex();
 }
+void RegFileTrace::appendLastWrites(const RegFileTrace &slice)
+{
+    vector<RegFileAccess>   lastWrites;
+    unordered_set<uint64_t> addrs;
+
+    for(size_t i=slice.regFileTrace.size();i-- > 0;){
+        RegFileAccess m = slice.regFileTrace[i];
+        if (addrs.insert(m.addr).second){
+            lastWrites.push_back(m);
+        }
+    }
 
+    for(auto it = lastWrites.rbegin(); it != lastWrites.rend(); ++it){
+        regFileTrace.push_back(*it);
+    }
+    updateIndex();
+}
 
-bool RegFileTrace::getValue(uint64_t time, uint64_t addr, uint64_t *value)
+
+void RegFileTrace::clearIndex()
+{
+    regWrites.clear();
+    checkpoints.clear();
+    indexedState    = RegFileState();
+    nrIndexedWrites = 0;
+}
+
+void RegFileTrace::updateIndex()
 {
-    bool        valueValid = false;
-    uint64_t    val;
+    // The trace was replaced.
+    if (regFileTrace.size() < nrIndexedWrites){
+        clearIndex();
+    }
+
+    for(;nrIndexedWrites < regFileTrace.size();++nrIndexedWrites){
+        RegFileAccess m = regFileTrace[nrIndexedWrites];
+
+        if (m.addr >= regWrites.size()){
+            regWrites.resize(m.addr+1);
+        }
+
+        regWrites[m.addr].push_back(nrIndexedWrites);
+
+        if (m.addr < NR_STATE_REGS){
+            indexedState.validMask      |= 1u << m.addr;
+            indexedState.values[m.addr]  = m.value;
+        }
+        indexedState.time       = m.time;
+        indexedState.writeIdx   = nrIndexedWrites+1;
+
+        if (indexedState.writeIdx % checkpointInterval != 0)
+            continue;
+
+        checkpoints.push_back(indexedState);
 
-    for(auto m: regFileTrace){
-        if (m.time > time)
-            break;
+        if (checkpoints.size() * sizeof(RegFileState) > checkpointMemBudget){
+            // Keep the checkpoints that are on a multiple of the doubled interval.
+            size_t nrKept = 0;
+            for(size_t i=1;i<checkpoints.size();i+=2){
+                checkpoints[nrKept++] = checkpoints[i];
+            }
+            checkpoints.resize(nrKept);
+            checkpointInterval *= 2;
 
-        if (m.wr && m.addr == addr){
-            valueValid      = true;
-            val             = m.value;
+            LOG_INFO("Register file checkpoint interval increased to %ld writes", checkpointInterval);
         }
     }
+}
+
+// Apply or undo the writes between the state and time. When that's more than a checkpoint 
+// interval of writes, start from the last checkpoint before time instead.
+void RegFileTrace::moveState(RegFileState &state, uint64_t time)
+{
+    updateIndex();
+
+    auto &times = regFileTrace.times;
+    size_t targetIdx = upper_bound(times.begin(), times.begin() + nrIndexedWrites, time) - times.begin();
 
-    if (valueValid){
-        *value      = val;
+    size_t distance = targetIdx > state.writeIdx ? targetIdx - state.writeIdx : state.writeIdx - targetIdx;
+    if (distance > checkpointInterval){
+        auto it = upper_bound(checkpoints.begin(), checkpoints.end(), time, 
+                              [](uint64_t time, const RegFileState &c){ return time < c.time; });
+
+        state = it == checkpoints.begin() ? RegFileState() : *(it-1);
     }
 
-    return valueValid;
-}
+    for(;state.writeIdx < targetIdx;++state.writeIdx){
+        RegFileAccess m = regFileTrace[state.writeIdx];
+        if (m.addr < NR_STATE_REGS){
+            state.validMask     |= 1u << m.addr;
+            state.values[m.addr] = m.value;
+        }
+    }
+
+    for(;state.writeIdx > targetIdx;--state.writeIdx){
+        RegFileAccess m = regFileTrace[state.writeIdx-1];
+        if (m.addr >= NR_STATE_REGS)
+            continue;
 
+        // The register gets the value of the write before this one back.
+        const TraceColumn<uint64_t> &writes = regWrites[m.addr];
+        size_t writeNr = lower_bound(writes.begin(), writes.end(), state.writeIdx-1) - writes.begin();
+        if (writeNr == 0){
+            state.validMask     &= ~(1u << m.addr);
+        }
+        else{
+            state.values[m.addr] = regFileTrace.values[writes[writeNr-1]];
+        }
+    }
 
+    state.time = time;
+}
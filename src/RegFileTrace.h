@@ -4,21 +4,89 @@
 #include <stdint.h>
 
 #include <FstProcess.h>
+#include <ClkSampler.h>
+#include <TraceColumn.h>
 
 struct RegFileAccess
 {
     uint64_t    time;
-    bool        wr;
     uint64_t    addr;
     uint64_t    value;
 };
 
+// The register file writes, stored as one column per field.
+class RegFileWrites
+{
+public:
+    TraceColumn<uint64_t>   times;
+    TraceColumn<uint8_t>    addrs;
+    TraceColumn<uint32_t>   values;
+
+    size_t size() const                         { return times.size(); }
+    RegFileAccess operator[](size_t idx) const  { return RegFileAccess{ times[idx], addrs[idx], values[idx] }; }
+
+    void push_back(const RegFileAccess &access)
+    {
+        times.push_back(access.time);
+        addrs.push_back(access.addr);
+        values.push_back(access.value);
+    }
+
+    // Move the writes to the end of these. writes is left empty.
+    void append(RegFileWrites &writes)
+    {
+        times.append(move(writes.times));
+        addrs.append(move(writes.addrs));
+        values.append(move(writes.values));
+    }
+
+    void clear()
+    {
+        times.clear();
+        addrs.clear();
+        values.clear();
+    }
+};
+
+#define NR_STATE_REGS      32
+
+// The values of all registers at time, after the first writeIdx records of the register 
+// file trace. validMask has a bit set for each register that has been written. 
+// A value-initialized state is the state before the first write.
+struct RegFileState
+{
+    uint64_t    time;
+    size_t      writeIdx;
+    uint32_t    validMask;
+    uint64_t    values[NR_STATE_REGS];
+};
+
 class RegFileTrace
 {
 public:
     RegFileTrace(FstProcess & fstProc, FstSignal clk, FstSignal memWr, FstSignal memAddr, FstSignal memWrData);
+
+    // Look up the signals in the FST file and subscribe to their value changes.
+    // Must be called before FstProcess::processValueChanges().
     void init();
 
+    // Record the register file write, if any, at the falling edge of the clock at time.
+    void sample(uint64_t time);
+
+    // Clock-free mode: sample all falling edges before time. Called before a value change.
+    void sampleUntil(uint64_t time);
+
+    // Clock-free mode: sample the falling edges after the last value change, up to endTime.
+    // Must be called after FstProcess::processValueChanges().
+    void finish(uint64_t endTime);
+
+    // Move the register file writes of a trace that was extracted for a later time range
+    // to the end of this one. The slice is left empty.
+    void append(RegFileTrace &slice);
+
+    // Only add the last write to each register of a trace that was extracted for an earlier time range.
+    void appendLastWrites(const RegFileTrace &slice);
+
     // Object to manage access to FST file
     FstProcess &    fstProc;
 
@@ -28,17 +96,46 @@ public:
     FstSignal       memAddr;
     FstSignal       memWrData;
 
+    // When enabled, the clock signal isn't decoded.
+    ClkSampler      clkSampler;
+
     // Helper signals for the FST callbacks to extract the PC values
-    bool            curMemWr;
+    uint64_t        curClkVal;
+    uint64_t        curMemWr;
     uint64_t        curMemAddr;
     uint64_t        curMemWrData;
 
-    // All PC values in the FST trace
-    vector<RegFileAccess>   regFileTrace;
+    // All register file writes in the FST trace
+    RegFileWrites       regFileTrace;
+
+    // For each register, the indexes in regFileTrace of the writes to it, so that the 
+    // previous write to the register can be found with a binary search.
+    vector<TraceColumn<uint64_t>>   regWrites;
+
+    // Number of records of regFileTrace that have been added to regWrites.
+    size_t              nrIndexedWrites;
+
+    // A checkpoint of the full register file every checkpointInterval writes, so that the 
+    // state at any time can be rebuilt by replaying at most checkpointInterval writes. 
+    // When the checkpoints would take more than checkpointMemBudget bytes, the interval is 
+    // doubled and every other checkpoint is dropped.
+    vector<RegFileState>        checkpoints;
+    uint64_t                    checkpointInterval;
+    uint64_t                    checkpointMemBudget;
+
+    // Register file state after the indexed writes.
+    RegFileState                indexedState;
+
+    // Add the records that were added to regFileTrace since the last call to regWrites and
+    // the checkpoints.
+    void updateIndex();
 
-    vector<RegFileAccess>::iterator regFileTraceIt;
+    // Drop regWrites and the checkpoints, to index regFileTrace from the start again.
+    void clearIndex();
 
-    bool getValue(uint64_t time, uint64_t addr, uint64_t *value);
+    // Move state to time. The cost is proportional to the number of writes between the old
+    // and the new time, but never more than a checkpoint interval.
+    void moveState(RegFileState &state, uint64_t time);
 };
 
 #endif
@@ -5,6 +5,7 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include "TcpServer.h"
@@ -93,6 +94,17 @@ ssize_t TcpServer::recv(void *buf, size_t buf_size)
     return ret;
 }
 
+bool TcpServer::dataAvailable(int timeoutMs)
+{
+    struct pollfd pfd;
+    pfd.fd      = socket_fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    int ret = ::poll(&pfd, 1, timeoutMs);
+    return ret > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR));
+}
+
 #if 0
 void tcpTest()
 {
@@ -13,6 +13,9 @@ public:
     ssize_t xmit(const void *buf, size_t len);
     ssize_t recv(void *buf, size_t buf_size);
 
+    // Wait up to timeoutMs for received data. Returns true when data can be read.
+    bool dataAvailable(int timeoutMs);
+
 private:
     int server_fd; 
     int socket_fd; 
@@ -0,0 +1,550 @@
+
+#include <exception>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "TraceCache.h"
+#include "Logger.h"
+
+using namespace std;
+
+static const char cacheMagic[8] = { 'G', 'D', 'B', 'W', 'A', 'V', 'E', 0 };
+
+TraceCache::TraceCache(FstProcess & fstProc, vector<string> signalNames, vector<string> indexSettings) :
+    cacheFileName(fstProc.fstFileName + ".gdbwave"),
+    mappedFile(nullptr),
+    mappedFileSize(0)
+{
+    struct stat st;
+    if (stat(fstProc.fstFileName.c_str(), &st) != 0){
+        return;
+    }
+
+    stringstream ss;
+    ss << "size: "          << st.st_size << endl;
+#if defined(__APPLE__)
+    ss << "mtime: "         << st.st_mtimespec.tv_sec << "." << st.st_mtimespec.tv_nsec << endl;
+#else
+    ss << "mtime: "         << st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec << endl;
+#endif
+    ss << "version: "       << fstProc.version() << endl;
+    ss << "date: "          << fstProc.date() << endl;
+    ss << "startTime: "     << fstProc.startTime() << endl;
+    ss << "endTime: "       << fstProc.endTime() << endl;
+    ss << "timescale: "     << fstProc.timescale() << endl;
+    ss << "varCount: "      << fstProc.varCount() << endl;
+    ss << "valueChangeSectionCount: " << fstProc.valueChangeSectionCount() << endl;
+
+    for(auto &name: signalNames){
+        ss << "signal: " << name << endl;
+    }
+
+    key = ss.str();
+
+    for(auto &setting: indexSettings){
+        indexKey += setting + "\n";
+    }
+}
+
+TraceCache::~TraceCache()
+{
+    if (mappedFile){
+        munmap(mappedFile, mappedFileSize);
+    }
+}
+
+//============================================================
+// Cache file layout:
+//
+// magic           8 bytes
+// formatVersion   uint32
+// key length      uint32
+// key             padded to a multiple of 8 bytes
+// For each column of each trace:
+//     items
+// index key length uint32
+// index key       padded to a multiple of 8 bytes
+// Register file index:
+//     nr registers, the writes of each register, the checkpoints, the index state
+// Memory index:
+//     the snapshot pages, which are shared by the snapshots
+//     nr pages, and for each page: page number, times, offsets, values
+//     nr snapshots, and for each snapshot: time, pages
+//     pages of the indexed image, the index state
+//
+// Items are stored as:
+//     nr items    uint64
+//     item size   uint64
+//     items       padded to a multiple of 8 bytes
+//
+// The columns are used in place, so items are at a multiple of 8 bytes from the start of 
+// the file.
+//============================================================
+
+// A page of a memory snapshot, by the number of the stored snapshot page.
+struct CachedSnapshotPage
+{
+    uint64_t    pageNr;
+    uint64_t    storedPageNr;
+};
+
+// What is left of the memory index state.
+struct CachedMemIndexState
+{
+    uint64_t    nrIndexedWrites;
+    uint64_t    snapshotInterval;
+    uint64_t    nextSnapshotTime;
+    uint64_t    indexedImageChanged;
+};
+
+struct CachedRegFileIndexState
+{
+    uint64_t        nrIndexedWrites;
+    uint64_t        checkpointInterval;
+    RegFileState    indexedState;
+};
+
+static void writePadding(ofstream &f, size_t len)
+{
+    static const char zeros[8] = { 0 };
+    f.write(zeros, (8 - (len & 7)) & 7);
+}
+
+static void writeItemsHeader(ofstream &f, uint64_t nrItems, uint64_t itemSize)
+{
+    f.write((const char *)&nrItems, sizeof(nrItems));
+    f.write((const char *)&itemSize, sizeof(itemSize));
+}
+
+template<typename T>
+static void writeItems(ofstream &f, const T *items, uint64_t nrItems)
+{
+    writeItemsHeader(f, nrItems, sizeof(T));
+    f.write((const char *)items, nrItems * sizeof(T));
+    writePadding(f, nrItems * sizeof(T));
+}
+
+template<typename T>
+static void writeValue(ofstream &f, const T &value)
+{
+    writeItems(f, &value, 1);
+}
+
+template<typename T>
+static void writeColumn(ofstream &f, const TraceColumn<T> &column)
+{
+    writeItemsHeader(f, column.size(), sizeof(T));
+    column.forEachChunk([&f](const T *values, size_t len){ f.write((const char *)values, len * sizeof(T)); });
+    writePadding(f, column.size() * sizeof(T));
+}
+
+template<typename T>
+static bool readItems(char *&ptr, const char *end, T *&items, uint64_t &nrItems)
+{
+    uint64_t itemSize;
+
+    if (end - ptr < (ptrdiff_t)(2 * sizeof(uint64_t)))
+        return false;
+
+    memcpy(&nrItems,  ptr, sizeof(nrItems));
+    memcpy(&itemSize, ptr + sizeof(nrItems), sizeof(itemSize));
+    ptr += 2 * sizeof(uint64_t);
+
+    if (itemSize != sizeof(T) || nrItems > (uint64_t)(end - ptr) / itemSize)
+        return false;
+
+    size_t len = nrItems * itemSize;
+    items = (T *)ptr;
+    ptr += (len + 7) & ~(size_t)7;
+
+    return true;
+}
+
+template<typename T>
+static bool readValue(char *&ptr, const char *end, T &value)
+{
+    T *         items;
+    uint64_t    nrItems;
+
+    if (!readItems(ptr, end, items, nrItems) || nrItems != 1)
+        return false;
+
+    memcpy((void *)&value, items, sizeof(T));
+    return true;
+}
+
+template<typename T>
+static bool readColumn(char *&ptr, const char *end, TraceColumn<T> &column)
+{
+    T *         items;
+    uint64_t    nrItems;
+
+    if (!readItems(ptr, end, items, nrItems))
+        return false;
+
+    column.clear();
+    column.appendExternal(items, nrItems);
+
+    return true;
+}
+
+static void writeRegFileIndex(ofstream &f, const RegFileTrace &regFileTrace)
+{
+    writeValue(f, (uint64_t)regFileTrace.regWrites.size());
+    for(auto &writes: regFileTrace.regWrites){
+        writeColumn(f, writes);
+    }
+
+    writeItems(f, regFileTrace.checkpoints.data(), regFileTrace.checkpoints.size());
+
+    CachedRegFileIndexState state;
+    memset((void *)&state, 0, sizeof(state));
+    state.nrIndexedWrites       = regFileTrace.nrIndexedWrites;
+    state.checkpointInterval    = regFileTrace.checkpointInterval;
+    state.indexedState          = regFileTrace.indexedState;
+    writeValue(f, state);
+}
+
+static bool readRegFileIndex(char *&ptr, const char *end, RegFileTrace &regFileTrace)
+{
+    uint64_t nrRegs;
+    if (!readValue(ptr, end, nrRegs) || nrRegs > (uint64_t)(end - ptr))
+        return false;
+
+    regFileTrace.regWrites.resize(nrRegs);
+    for(auto &writes: regFileTrace.regWrites){
+        if (!readColumn(ptr, end, writes))
+            return false;
+    }
+
+    // The checkpoints are thinned out in place, so they are copied.
+    RegFileState *  checkpoints;
+    uint64_t        nrCheckpoints;
+    if (!readItems(ptr, end, checkpoints, nrCheckpoints))
+        return false;
+    regFileTrace.checkpoints.assign(checkpoints, checkpoints + nrCheckpoints);
+
+    CachedRegFileIndexState state;
+    if (!readValue(ptr, end, state) || state.nrIndexedWrites != regFileTrace.regFileTrace.size())
+        return false;
+
+    regFileTrace.nrIndexedWrites    = state.nrIndexedWrites;
+    regFileTrace.checkpointInterval = state.checkpointInterval;
+    regFileTrace.indexedState       = state.indexedState;
+
+    return true;
+}
+
+static void writeMemIndex(ofstream &f, const MemTrace &memTrace)
+{
+    // Each snapshot page is only stored once, however many snapshots use it.
+    unordered_map<const MemSnapshotPage *, uint64_t>    storedPageNrs;
+    vector<const MemSnapshotPage *>                     storedPages;
+
+    auto storedPageNr = [&](const MemSnapshotPage *page) -> uint64_t {
+        auto it = storedPageNrs.find(page);
+        if (it != storedPageNrs.end())
+            return it->second;
+
+        storedPageNrs[page] = storedPages.size();
+        storedPages.push_back(page);
+        return storedPages.size()-1;
+    };
+
+    vector<vector<CachedSnapshotPage>> snapshotPages;
+    for(auto &snapshot: memTrace.snapshots){
+        snapshotPages.emplace_back();
+        for(auto &page: snapshot.pages){
+            snapshotPages.back().push_back(CachedSnapshotPage{ page.first, storedPageNr(page.second.get()) });
+        }
+    }
+
+    vector<CachedSnapshotPage> imagePages;
+    for(auto &page: memTrace.indexedImage){
+        imagePages.push_back(CachedSnapshotPage{ page.first, storedPageNr(page.second.get()) });
+    }
+
+    writeItemsHeader(f, storedPages.size(), sizeof(MemSnapshotPage));
+    for(auto page: storedPages){
+        f.write((const char *)page, sizeof(MemSnapshotPage));
+    }
+    writePadding(f, storedPages.size() * sizeof(MemSnapshotPage));
+
+    writeValue(f, (uint64_t)memTrace.memIndex.size());
+    for(auto &page: memTrace.memIndex){
+        writeValue(f, (uint64_t)page.first);
+        writeColumn(f, page.second->times);
+        writeColumn(f, page.second->offsets);
+        writeColumn(f, page.second->values);
+    }
+
+    writeValue(f, (uint64_t)memTrace.snapshots.size());
+    for(size_t i=0;i<memTrace.snapshots.size();++i){
+        writeValue(f, memTrace.snapshots[i].time);
+        writeItems(f, snapshotPages[i].data(), snapshotPages[i].size());
+    }
+
+    writeItems(f, imagePages.data(), imagePages.size());
+
+    CachedMemIndexState state;
+    state.nrIndexedWrites       = memTrace.nrIndexedWrites;
+    state.snapshotInterval      = memTrace.snapshotInterval;
+    state.nextSnapshotTime      = memTrace.nextSnapshotTime;
+    state.indexedImageChanged   = memTrace.indexedImageChanged;
+    writeValue(f, state);
+}
+
+static bool readMemIndex(char *&ptr, const char *end, MemTrace &memTrace)
+{
+    MemSnapshotPage *   storedPages;
+    uint64_t            nrStoredPages;
+    if (!readItems(ptr, end, storedPages, nrStoredPages))
+        return false;
+
+    // The snapshot pages are used in place. The snapshots and the indexed image share them 
+    // the way they did when they were stored, so that a page that is written after the 
+    // snapshot is copied first.
+    vector<shared_ptr<MemSnapshotPage>> pages(nrStoredPages);
+    for(uint64_t i=0;i<nrStoredPages;++i){
+        pages[i] = shared_ptr<MemSnapshotPage>(&storedPages[i], [](MemSnapshotPage *){});
+    }
+
+    auto readPages = [&](auto &pageMap) -> bool {
+        CachedSnapshotPage *    snapshotPages;
+        uint64_t                nrPages;
+        if (!readItems(ptr, end, snapshotPages, nrPages))
+            return false;
+
+        pageMap.reserve(nrPages);
+        for(uint64_t i=0;i<nrPages;++i){
+            if (snapshotPages[i].storedPageNr >= nrStoredPages)
+                return false;
+            pageMap[snapshotPages[i].pageNr] = pages[snapshotPages[i].storedPageNr];
+        }
+        return true;
+    };
+
+    uint64_t nrIndexPages;
+    if (!readValue(ptr, end, nrIndexPages))
+        return false;
+
+    memTrace.memIndex.reserve(nrIndexPages);
+    for(uint64_t i=0;i<nrIndexPages;++i){
+        uint64_t pageNr;
+        unique_ptr<MemIndexPage> page(new MemIndexPage());
+
+        if (!readValue(ptr, end, pageNr) || 
+            !readColumn(ptr, end, page->times) ||
+            !readColumn(ptr, end, page->offsets) ||
+            !readColumn(ptr, end, page->values))
+            return false;
+
+        memTrace.memIndex[pageNr] = move(page);
+    }
+
+    uint64_t nrSnapshots;
+    if (!readValue(ptr, end, nrSnapshots) || nrSnapshots > (uint64_t)(end - ptr))
+        return false;
+
+    memTrace.snapshots.resize(nrSnapshots);
+    for(auto &snapshot: memTrace.snapshots){
+        if (!readValue(ptr, end, snapshot.time) || !readPages(snapshot.pages))
+            return false;
+    }
+
+    if (!readPages(memTrace.indexedImage))
+        return false;
+
+    CachedMemIndexState state;
+    if (!readValue(ptr, end, state) || state.nrIndexedWrites != memTrace.memTrace.size())
+        return false;
+
+    memTrace.nrIndexedWrites        = state.nrIndexedWrites;
+    memTrace.snapshotInterval       = state.snapshotInterval;
+    memTrace.nextSnapshotTime       = state.nextSnapshotTime;
+    memTrace.indexedImageChanged    = state.indexedImageChanged;
+
+    return true;
+}
+
+// Returns false when the index settings are different: the indexes are then left empty.
+static bool readIndexes(char *&ptr, const char *end, const string &indexKey, RegFileTrace &regFileTrace, MemTrace &memTrace)
+{
+    uint32_t keyLen;
+
+    if (end - ptr < (ptrdiff_t)sizeof(keyLen))
+        return false;
+    memcpy(&keyLen, ptr, sizeof(keyLen));
+    ptr += sizeof(keyLen);
+
+    if (keyLen != indexKey.size() || keyLen > (size_t)(end - ptr) || memcmp(ptr, indexKey.data(), keyLen) != 0)
+        return false;
+    ptr += (sizeof(keyLen) + keyLen + 7) / 8 * 8 - sizeof(keyLen);
+
+    if (!readRegFileIndex(ptr, end, regFileTrace) || !readMemIndex(ptr, end, memTrace)){
+        regFileTrace.clearIndex();
+        memTrace.clearIndex();
+        return false;
+    }
+
+    return true;
+}
+
+bool TraceCache::load(CpuTrace &cpuTrace, RegFileTrace &regFileTrace, MemTrace &memTrace)
+{
+    if (key.empty())
+        return false;
+
+    int fd = open(cacheFileName.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0){
+        close(fd);
+        return false;
+    }
+
+    // The mapping is private: the columns never change their records, but if they did, 
+    // the file would stay the same.
+    size_t fileSize = st.st_size;
+    void *base = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED){
+        LOG_WARNING("Could not map cache file %s (%s)", cacheFileName.c_str(), strerror(errno));
+        return false;
+    }
+
+    char *ptr       = (char *)base;
+    const char *end = ptr + fileSize;
+    bool valid      = false;
+
+    do{
+        uint32_t version, keyLen;
+
+        if (fileSize < sizeof(cacheMagic) + 2 * sizeof(uint32_t) || memcmp(ptr, cacheMagic, sizeof(cacheMagic)) != 0)
+            break;
+        ptr += sizeof(cacheMagic);
+
+        memcpy(&version, ptr, sizeof(version));
+        memcpy(&keyLen,  ptr + sizeof(version), sizeof(keyLen));
+        ptr += 2 * sizeof(uint32_t);
+
+        if (version != formatVersion){
+            LOG_INFO("Cache file %s has a different format version. Ignoring...", cacheFileName.c_str());
+            break;
+        }
+
+        if (keyLen != key.size() || keyLen > (size_t)(end - ptr) || memcmp(ptr, key.data(), keyLen) != 0){
+            LOG_INFO("Cache file %s doesn't match FST file or configuration. Ignoring...", cacheFileName.c_str());
+            break;
+        }
+        ptr += (keyLen + 7) & ~(size_t)7;
+
+        if (!readColumn(ptr, end, cpuTrace.pcTrace.blocks) || 
+            !readColumn(ptr, end, cpuTrace.pcTrace.bytes) || 
+            !readColumn(ptr, end, cpuTrace.pcTrace.branchBytes))
+            break;
+        cpuTrace.pcTrace.restoreEncoder();
+        if (!readColumn(ptr, end, regFileTrace.regFileTrace.times) || 
+            !readColumn(ptr, end, regFileTrace.regFileTrace.addrs) || 
+            !readColumn(ptr, end, regFileTrace.regFileTrace.values))
+            break;
+        if (!readColumn(ptr, end, memTrace.memTrace.times) || 
+            !readColumn(ptr, end, memTrace.memTrace.addrs) || 
+            !readColumn(ptr, end, memTrace.memTrace.values))
+            break;
+
+        valid = true;
+
+        if (!readIndexes(ptr, end, indexKey, regFileTrace, memTrace)){
+            LOG_INFO("Cache file %s has indexes with different settings. Rebuilding them...", cacheFileName.c_str());
+        }
+    } while(0);
+
+    if (!valid){
+        cpuTrace.pcTrace.clear();
+        regFileTrace.regFileTrace.clear();
+        memTrace.memTrace.clear();
+        munmap(base, fileSize);
+        return false;
+    }
+
+    // The traces no longer use the file that was loaded before, if any.
+    if (mappedFile){
+        munmap(mappedFile, mappedFileSize);
+    }
+    mappedFile      = base;
+    mappedFileSize  = fileSize;
+
+    LOG_INFO("Loaded traces from cache file %s", cacheFileName.c_str());
+    return true;
+}
+
+bool TraceCache::save(CpuTrace &cpuTrace, RegFileTrace &regFileTrace, MemTrace &memTrace)
+{
+    if (key.empty())
+        return false;
+
+    // Write to a temporary file first so that an interrupted write never leaves 
+    // behind a cache file that looks valid.
+    string tmpFileName = cacheFileName + ".tmp";
+
+    {
+        ofstream f(tmpFileName, ios::out | ios::binary | ios::trunc);
+        if (f.fail()){
+            LOG_WARNING("Could not create cache file %s (%s)", tmpFileName.c_str(), strerror(errno));
+            return false;
+        }
+
+        uint32_t version    = formatVersion;
+        uint32_t keyLen     = key.size();
+
+        f.write(cacheMagic, sizeof(cacheMagic));
+        f.write((const char *)&version, sizeof(version));
+        f.write((const char *)&keyLen, sizeof(keyLen));
+        f.write(key.data(), keyLen);
+        writePadding(f, keyLen);
+
+        writeColumn(f, cpuTrace.pcTrace.blocks);
+        writeColumn(f, cpuTrace.pcTrace.bytes);
+        writeColumn(f, cpuTrace.pcTrace.branchBytes);
+        writeColumn(f, regFileTrace.regFileTrace.times);
+        writeColumn(f, regFileTrace.regFileTrace.addrs);
+        writeColumn(f, regFileTrace.regFileTrace.values);
+        writeColumn(f, memTrace.memTrace.times);
+        writeColumn(f, memTrace.memTrace.addrs);
+        writeColumn(f, memTrace.memTrace.values);
+
+        uint32_t indexKeyLen = indexKey.size();
+        f.write((const char *)&indexKeyLen, sizeof(indexKeyLen));
+        f.write(indexKey.data(), indexKeyLen);
+        writePadding(f, sizeof(indexKeyLen) + indexKeyLen);
+
+        writeRegFileIndex(f, regFileTrace);
+        writeMemIndex(f, memTrace);
+
+        f.close();
+        if (f.fail()){
+            LOG_WARNING("Error writing cache file %s", tmpFileName.c_str());
+            remove(tmpFileName.c_str());
+            return false;
+        }
+    }
+
+    if (rename(tmpFileName.c_str(), cacheFileName.c_str()) != 0){
+        LOG_WARNING("Could not rename cache file %s (%s)", tmpFileName.c_str(), strerror(errno));
+        remove(tmpFileName.c_str());
+        return false;
+    }
+
+    LOG_INFO("Wrote traces to cache file %s", cacheFileName.c_str());
+    return true;
+}
@@ -0,0 +1,46 @@
+#ifndef TRACE_CACHE_H
+#define TRACE_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "FstProcess.h"
+#include "CpuTrace.h"
+#include "RegFileTrace.h"
+#include "MemTrace.h"
+
+// Sidecar file next to the FST file that contains the traces that were extracted from it, so 
+// that they don't need to be decoded again the next time. The records and the indexes over 
+// them are stored the way they are in memory, and used in place.
+// The cache is only used when the size, the modification time and the header of the FST file,
+// and the set of configured signals are the same as when the cache file was written. The 
+// indexes are only used when they were built with the same settings: otherwise they are 
+// rebuilt from the records when they are first needed.
+class TraceCache
+{
+public:
+    TraceCache(FstProcess & fstProc, vector<string> signalNames, vector<string> indexSettings);
+    ~TraceCache();
+
+    bool load(CpuTrace &cpuTrace, RegFileTrace &regFileTrace, MemTrace &memTrace);
+    bool save(CpuTrace &cpuTrace, RegFileTrace &regFileTrace, MemTrace &memTrace);
+
+    // Must be incremented whenever the layout of the cache file or of the records changes.
+    static const uint32_t formatVersion = 7;
+
+    string      cacheFileName;
+
+    // Identifies the FST file and the configuration from which the traces were extracted.
+    string      key;
+
+    // The settings of the indexes.
+    string      indexKey;
+
+    // The loaded cache file. The columns of the traces use its records in place, so it stays 
+    // mapped as long as the cache.
+    void *      mappedFile;
+    size_t      mappedFileSize;
+};
+
+#endif
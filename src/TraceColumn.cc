@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <map>
+#include <mutex>
+
+#include "TraceColumn.h"
+
+// A mapped region of the spill file. Chunks are allocated from its start on, and never
+// reused: the region goes away when all of them have been freed.
+struct SpillRegion
+{
+    off_t       offset;
+    size_t      used;
+    size_t      nrChunks;
+};
+
+// The spill file, and its regions by start address. The decode threads allocate chunks
+// concurrently.
+static mutex                        spillMutex;
+static int                          spillFd = -1;
+static off_t                        spillFileSize = 0;
+static map<char *, SpillRegion>     spillRegions;
+static char *                       curSpillRegion = nullptr;
+
+// Freed chunks of the maximum size. The decode threads allocate and free chunks concurrently.
+static mutex                        chunkPoolMutex;
+static vector<void *>               freeMaxChunks;
+
+static int createSpillFile(const string &dir)
+{
+    string fileName = dir + "/gdbwave.XXXXXX";
+    vector<char> name(fileName.begin(), fileName.end());
+    name.push_back(0);
+
+    int fd = mkstemp(name.data());
+    if (fd < 0){
+        LOG_ERROR("Could not create spill file in %s (%s)", dir.c_str(), strerror(errno));
+        exit(1);
+    }
+
+    // Only the descriptor refers to the file now, so it's removed when it's closed,
+    // even when gdbwave doesn't exit cleanly.
+    unlink(name.data());
+
+    return fd;
+}
+
+void spillTraceChunks(const string &dir)
+{
+    lock_guard<mutex> lock(spillMutex);
+    spillFd = createSpillFile(dir);
+}
+
+// Give the disk space of the whole pages in [offset, offset+len) of the spill file back.
+// Their contents are dropped from memory too.
+static void releaseSpillPages(off_t offset, size_t len)
+{
+#ifdef __linux__
+    off_t pageSize  = sysconf(_SC_PAGESIZE);
+    off_t start     = (offset + pageSize - 1) / pageSize * pageSize;
+    off_t end       = (offset + (off_t)len) / pageSize * pageSize;
+
+    if (start < end && fallocate(spillFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) != 0){
+        LOG_WARNING("Could not release spill file pages (%s)", strerror(errno));
+    }
+#endif
+}
+
+static void releaseSpillRegion(map<char *, SpillRegion>::iterator it)
+{
+    releaseSpillPages(it->second.offset, TRACE_SPILL_REGION_BYTES);
+    munmap(it->first, TRACE_SPILL_REGION_BYTES);
+    spillRegions.erase(it);
+}
+
+static void *allocSpillChunk(size_t bytes)
+{
+    // Chunks start at an 8 byte boundary, for the values that they hold.
+    bytes = (bytes + 7) & ~(size_t)7;
+
+    if (curSpillRegion == nullptr || spillRegions[curSpillRegion].used + bytes > TRACE_SPILL_REGION_BYTES){
+        // The file grows by one region at a time. It's sparse until the chunks are written.
+        if (ftruncate(spillFd, spillFileSize + TRACE_SPILL_REGION_BYTES) != 0){
+            LOG_ERROR("Could not grow spill file (%s)", strerror(errno));
+            exit(1);
+        }
+
+        void *region = mmap(NULL, TRACE_SPILL_REGION_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, spillFd, spillFileSize);
+        if (region == MAP_FAILED){
+            LOG_ERROR("Could not map spill file (%s)", strerror(errno));
+            exit(1);
+        }
+
+        // From now on, the previous region is released with its last chunk.
+        if (curSpillRegion != nullptr && spillRegions[curSpillRegion].nrChunks == 0){
+            releaseSpillRegion(spillRegions.find(curSpillRegion));
+        }
+
+        curSpillRegion = (char *)region;
+        spillRegions[curSpillRegion] = SpillRegion{ spillFileSize, 0, 0 };
+        spillFileSize += TRACE_SPILL_REGION_BYTES;
+    }
+
+    SpillRegion &region = spillRegions[curSpillRegion];
+    char *chunk = curSpillRegion + region.used;
+    region.used += bytes;
+    ++region.nrChunks;
+
+    return chunk;
+}
+
+// Returns false when chunk isn't in the spill file.
+static bool freeSpillChunk(void *chunk, size_t bytes)
+{
+    auto it = spillRegions.upper_bound((char *)chunk);
+    if (it == spillRegions.begin())
+        return false;
+    --it;
+
+    char *regionStart = it->first;
+    SpillRegion &region = it->second;
+    if ((char *)chunk >= regionStart + TRACE_SPILL_REGION_BYTES)
+        return false;
+
+    // Pages that are shared with other chunks are kept until the region goes away.
+    releaseSpillPages(region.offset + ((char *)chunk - regionStart), bytes);
+
+    if (--region.nrChunks == 0 && regionStart != curSpillRegion){
+        releaseSpillRegion(it);
+    }
+
+    return true;
+}
+
+static size_t mappedChunkBytes(size_t bytes)
+{
+    return bytes > TRACE_COLUMN_MAX_CHUNK_BYTES / 2 ? TRACE_COLUMN_MAX_CHUNK_BYTES : bytes;
+}
+
+void *allocTraceChunk(size_t bytes)
+{
+    void *chunk;
+
+    {
+        lock_guard<mutex> lock(spillMutex);
+        if (spillFd >= 0){
+            return allocSpillChunk(bytes);
+        }
+    }
+
+    if (bytes < TRACE_CHUNK_MAP_BYTES){
+        chunk = malloc(bytes);
+        if (chunk == NULL){
+            LOG_ERROR("Could not allocate trace chunk");
+            exit(1);
+        }
+        return chunk;
+    }
+
+    if (bytes > TRACE_COLUMN_MAX_CHUNK_BYTES / 2){
+        lock_guard<mutex> lock(chunkPoolMutex);
+        if (!freeMaxChunks.empty()){
+            chunk = freeMaxChunks.back();
+            freeMaxChunks.pop_back();
+            return chunk;
+        }
+    }
+
+    chunk = mmap(NULL, mappedChunkBytes(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED){
+        LOG_ERROR("Could not allocate trace chunk (%s)", strerror(errno));
+        exit(1);
+    }
+
+    return chunk;
+}
+
+void freeTraceChunk(void *chunk, size_t bytes)
+{
+    {
+        lock_guard<mutex> lock(spillMutex);
+        if (spillFd >= 0 && freeSpillChunk(chunk, bytes)){
+            return;
+        }
+    }
+
+    if (bytes < TRACE_CHUNK_MAP_BYTES){
+        free(chunk);
+        return;
+    }
+
+    if (bytes > TRACE_COLUMN_MAX_CHUNK_BYTES / 2){
+        lock_guard<mutex> lock(chunkPoolMutex);
+        if (freeMaxChunks.size() < TRACE_CHUNK_POOL_MAX_FREE){
+#ifdef MADV_FREE
+            // The OS may take the pages back when it runs low on memory. Until then, 
+            // the next column reuses them without page faults.
+            madvise(chunk, TRACE_COLUMN_MAX_CHUNK_BYTES, MADV_FREE);
+#endif
+            freeMaxChunks.push_back(chunk);
+            return;
+        }
+    }
+
+    munmap(chunk, mappedChunkBytes(bytes));
+}
@@ -0,0 +1,283 @@
+#ifndef TRACE_COLUMN_H
+#define TRACE_COLUMN_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <type_traits>
+
+#include "Logger.h"
+
+using namespace std;
+
+// The chunks of a column start small and double in size up to TRACE_COLUMN_MAX_CHUNK_BYTES.
+#define TRACE_COLUMN_FIRST_CHUNK_BYTES  256
+#define TRACE_COLUMN_MAX_CHUNK_BYTES    (4 << 20)
+
+// Chunks of at least TRACE_CHUNK_MAP_BYTES are mapped directly: their pages only use memory
+// once they're written, and go back to the OS when the chunk is freed. Smaller chunks come
+// from the heap.
+#define TRACE_CHUNK_MAP_BYTES           (64 << 10)
+
+// Chunks of more than half the maximum size are all mapped at the maximum size. Up to
+// TRACE_CHUNK_POOL_MAX_FREE of them are kept when they're freed, for the next column that 
+// grows: the seed traces of a window and the queued bus cycles of a slice are freed right 
+// before the traces allocate chunks of the same size.
+#define TRACE_CHUNK_POOL_MAX_FREE       16
+
+// When spilling, chunks are carved out of memory-mapped regions of TRACE_SPILL_REGION_BYTES 
+// of a temporary file. A region is unmapped when all its chunks have been freed.
+#define TRACE_SPILL_REGION_BYTES        (64 << 20)
+
+// From now on, allocate the chunks of all trace columns in an unnamed temporary file in dir.
+// The OS can write them back and drop them when memory runs low, so that traces can be 
+// larger than memory. Must be called before any trace is decoded.
+void spillTraceChunks(const string &dir);
+
+void *allocTraceChunk(size_t bytes);
+void freeTraceChunk(void *chunk, size_t bytes);
+
+// An append-only array of values, stored in chunks. Values never move once they have been
+// added: growing the column only adds chunks.
+//
+// The chunks of another column can be moved to the end of a column. Then a chunk that
+// isn't full can be followed by other chunks, so a value is found with a binary search
+// on the first index of each chunk.
+template<typename T>
+class TraceColumn
+{
+    static_assert(is_trivially_copyable<T>::value, "Trace column values must be trivially copyable");
+
+public:
+    static const size_t firstChunkSize  = (TRACE_COLUMN_FIRST_CHUNK_BYTES + sizeof(T) - 1) / sizeof(T);
+    static const size_t maxChunkSize    = TRACE_COLUMN_MAX_CHUNK_BYTES / sizeof(T);
+
+    TraceColumn() : nrValues(0), nextChunkSize(firstChunkSize) {}
+
+    ~TraceColumn()
+    {
+        releaseChunks();
+    }
+
+    TraceColumn(const TraceColumn &)            = delete;
+    TraceColumn &operator=(const TraceColumn &) = delete;
+
+    TraceColumn(TraceColumn &&column) noexcept :
+        chunks(move(column.chunks)),
+        nrValues(column.nrValues),
+        nextChunkSize(column.nextChunkSize)
+    {
+        column.chunks.clear();
+        column.nrValues         = 0;
+        column.nextChunkSize    = firstChunkSize;
+    }
+
+    size_t size() const                             { return nrValues; }
+    bool empty() const                              { return nrValues == 0; }
+
+    T &operator[](size_t idx)
+    {
+        const Chunk &chunk = chunks[chunkNr(idx)];
+        return chunk.values[idx - chunk.start];
+    }
+
+    const T &operator[](size_t idx) const
+    {
+        const Chunk &chunk = chunks[chunkNr(idx)];
+        return chunk.values[idx - chunk.start];
+    }
+
+    // The values of the chunk that holds idx, which are at indexes [*start, *end).
+    const T *chunkOf(size_t idx, size_t *start, size_t *end) const
+    {
+        const Chunk &chunk = chunks[chunkNr(idx)];
+        *start  = chunk.start;
+        *end    = chunk.start + chunk.nrValues;
+        return chunk.values;
+    }
+
+    void push_back(const T &value)
+    {
+        if (chunks.empty() || chunks.back().nrValues == chunks.back().size){
+            addChunk();
+        }
+        Chunk &chunk = chunks.back();
+        chunk.values[chunk.nrValues++] = value;
+        ++nrValues;
+    }
+
+    void append(const T *values, size_t len)
+    {
+        while(len > 0){
+            if (chunks.empty() || chunks.back().nrValues == chunks.back().size){
+                addChunk();
+            }
+
+            Chunk &chunk = chunks.back();
+            size_t n = min(len, chunk.size - chunk.nrValues);
+            memcpy((void *)&chunk.values[chunk.nrValues], values, n * sizeof(T));
+            chunk.nrValues += n;
+            nrValues       += n;
+            values         += n;
+            len            -= n;
+        }
+    }
+
+    // Add the len values at values as a chunk that is used in place, and isn't freed with the
+    // column. values must stay valid as long as the column uses them.
+    void appendExternal(T *values, size_t len)
+    {
+        if (len == 0)
+            return;
+
+        Chunk chunk;
+        chunk.values    = values;
+        chunk.start     = nrValues;
+        chunk.nrValues  = len;
+        chunk.size      = len;
+        chunk.external  = true;
+        chunks.push_back(chunk);
+
+        nrValues += len;
+    }
+
+    // Move the chunks of column to the end of this one, without copying values.
+    //
+    // column is left empty. It continues with a chunk that holds as many values as were
+    // moved, so that a column that is moved at regular intervals gets one chunk per interval.
+    void append(TraceColumn &&column)
+    {
+        for(Chunk &chunk: column.chunks){
+            chunk.start = nrValues;
+            nrValues   += chunk.nrValues;
+            chunks.push_back(chunk);
+        }
+
+        column.nextChunkSize = firstChunkSize;
+        while(column.nextChunkSize < column.nrValues && column.nextChunkSize < maxChunkSize){
+            column.nextChunkSize *= 2;
+        }
+        column.nextChunkSize = min(column.nextChunkSize, maxChunkSize);
+        column.chunks.clear();
+        column.nrValues = 0;
+    }
+
+    // Call f(values, len) for each chunk, in order.
+    template<typename F>
+    void forEachChunk(F f) const
+    {
+        for(const Chunk &chunk: chunks){
+            f((const T *)chunk.values, chunk.nrValues);
+        }
+    }
+
+    void clear()
+    {
+        releaseChunks();
+        nrValues        = 0;
+        nextChunkSize   = firstChunkSize;
+    }
+
+    // A random access iterator, for the binary searches on time columns.
+    class const_iterator
+    {
+    public:
+        typedef random_access_iterator_tag  iterator_category;
+        typedef T                           value_type;
+        typedef ptrdiff_t                   difference_type;
+        typedef const T *                   pointer;
+        typedef const T &                   reference;
+
+        const_iterator(const TraceColumn *column, size_t idx) : column(column), idx(idx) {}
+
+        reference operator*() const                             { return (*column)[idx]; }
+        reference operator[](difference_type n) const           { return (*column)[idx + n]; }
+
+        const_iterator &operator++()                            { ++idx; return *this; }
+        const_iterator &operator--()                            { --idx; return *this; }
+        const_iterator operator++(int)                          { return const_iterator(column, idx++); }
+        const_iterator operator--(int)                          { return const_iterator(column, idx--); }
+        const_iterator &operator+=(difference_type n)           { idx += n; return *this; }
+        const_iterator &operator-=(difference_type n)           { idx -= n; return *this; }
+        const_iterator operator+(difference_type n) const       { return const_iterator(column, idx + n); }
+        const_iterator operator-(difference_type n) const       { return const_iterator(column, idx - n); }
+        difference_type operator-(const const_iterator &it) const  { return idx - it.idx; }
+
+        bool operator==(const const_iterator &it) const         { return idx == it.idx; }
+        bool operator!=(const const_iterator &it) const         { return idx != it.idx; }
+        bool operator<(const const_iterator &it) const          { return idx < it.idx; }
+
+    private:
+        const TraceColumn * column;
+        size_t              idx;
+    };
+
+    const_iterator begin() const                    { return const_iterator(this, 0); }
+    const_iterator end() const                      { return const_iterator(this, nrValues); }
+
+private:
+    struct Chunk {
+        T *         values;
+        size_t      start;
+        size_t      nrValues;
+        size_t      size;
+        bool        external;
+    };
+
+    vector<Chunk>   chunks;
+    size_t          nrValues;
+    size_t          nextChunkSize;
+
+    // The chunk that holds idx. idx must be smaller than the number of values, so there
+    // is at least one chunk.
+    size_t chunkNr(size_t idx) const
+    {
+        if (chunks.empty()){
+            LOG_ERROR("Trace column index %zu out of range (empty column)", idx);
+            exit(1);
+        }
+
+        // Most accesses are to the last chunk.
+        if (idx >= chunks.back().start)
+            return chunks.size()-1;
+
+        return upper_bound(chunks.begin(), chunks.end(), idx,
+                           [](size_t idx, const Chunk &chunk){ return idx < chunk.start; }) - chunks.begin() - 1;
+    }
+
+    void addChunk()
+    {
+        Chunk chunk;
+        chunk.values    = (T *)allocTraceChunk(nextChunkSize * sizeof(T));
+        chunk.start     = nrValues;
+        chunk.nrValues  = 0;
+        chunk.size      = nextChunkSize;
+        chunk.external  = false;
+        chunks.push_back(chunk);
+
+        nextChunkSize   = min(nextChunkSize * 2, maxChunkSize);
+    }
+
+    void releaseChunks()
+    {
+        for(Chunk &chunk: chunks){
+            if (!chunk.external){
+                freeTraceChunk(chunk.values, chunk.size * sizeof(T));
+            }
+        }
+        chunks.clear();
+    }
+};
+
+template<typename T>
+const size_t TraceColumn<T>::firstChunkSize;
+
+template<typename T>
+const size_t TraceColumn<T>::maxChunkSize;
+
+#endif
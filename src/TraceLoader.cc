@@ -0,0 +1,637 @@
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <thread>
+
+#include "TraceLoader.h"
+#include "Logger.h"
+
+using namespace std;
+
+TraceLoader::TraceLoader(FstProcess & fstProc, CpuTrace & cpuTrace, RegFileTrace & regFileTrace, MemTrace & memTrace, 
+                         TraceCache * traceCache, int nrThreads, bool followMode) :
+    fstProc(fstProc),
+    cpuTrace(cpuTrace),
+    regFileTrace(regFileTrace),
+    memTrace(memTrace),
+    traceCache(traceCache),
+    nrThreads(nrThreads),
+    followMode(followMode),
+    initialized(false),
+    fstComplete(!followMode || fstProc.isComplete()),
+    fstEndTime(fstProc.endTime()),
+    windowSize(0),
+    loadedEndTime(0),
+    background(false),
+    cacheSaved(false),
+    cancelled(false)
+{
+    for(auto &decode: decodes){
+        decode.started      = false;
+        decode.loading      = false;
+        decode.slices       = nullptr;
+        decode.nextSlice    = 0;
+        decode.loadedUntil  = 0;
+    }
+}
+
+TraceLoader::~TraceLoader()
+{
+    {
+        lock_guard<mutex> lock(traceMutex);
+        cancelled = true;
+        traceChanged.notify_all();
+    }
+
+    // The CPU decode starts the other decodes when it is done, unless it was cancelled.
+    for(auto &decode: decodes){
+        if (decode.loaderThread.joinable()){
+            decode.loaderThread.join();
+        }
+    }
+}
+
+// Only look up the signals when the FST file must really be decoded.
+void TraceLoader::init()
+{
+    if (initialized)
+        return;
+
+    cpuTrace.init();
+    regFileTrace.init();
+    memTrace.init();
+
+    initialized = true;
+}
+
+void TraceLoader::logTraceSizes()
+{
+    LOG_INFO("Nr CPU instructions: %ld", cpuTrace.pcTrace.size());
+    LOG_INFO("Nr regfile write transactions: %ld", regFileTrace.regFileTrace.size());
+    LOG_INFO("Nr mem write transactions: %ld", memTrace.memTrace.size());
+}
+
+void TraceLoader::load()
+{
+    if (traceCache && traceCache->load(cpuTrace, regFileTrace, memTrace)){
+        loadedEndTime   = fstEndTime;
+        logTraceSizes();
+        return;
+    }
+
+    LOG_INFO("Decoding trace in the background...");
+
+    // The slices get the signal handles from the traces, so that the hierarchy is only 
+    // walked here.
+    init();
+
+    lock_guard<mutex> lock(traceMutex);
+    background  = true;
+    startDecode(CPU);
+}
+
+bool TraceLoader::isLoading()
+{
+    lock_guard<mutex> lock(traceMutex);
+    return backgroundLoading();
+}
+
+bool TraceLoader::pcLoaded(size_t pcTraceIdx)
+{
+    lock_guard<mutex> lock(traceMutex);
+    return pcTraceIdx < cpuTrace.pcTrace.size();
+}
+
+void TraceLoader::waitForProgress(int timeoutMs)
+{
+    unique_lock<mutex> lock(traceMutex);
+    if (backgroundLoading()){
+        traceChanged.wait_for(lock, chrono::milliseconds(timeoutMs));
+    }
+}
+
+void TraceLoader::waitForTrace(Subsystem subsystem, uint64_t time)
+{
+    unique_lock<mutex> lock(traceMutex);
+    if (!background)
+        return;
+
+    BackgroundDecode &decode = decodes[subsystem];
+    if (!decode.started){
+        LOG_INFO("Decoding %s trace in the background...", subsystem == REG_FILE ? "register file" : "memory");
+        startDecode(subsystem);
+    }
+
+    while(decode.loading && decode.loadedUntil <= time && !cancelled){
+        traceChanged.wait(lock);
+    }
+}
+
+void TraceLoader::loadWindow(uint64_t startTime, uint64_t endTime)
+{
+    // The cache file always contains the full trace.
+    if (traceCache && traceCache->load(cpuTrace, regFileTrace, memTrace)){
+        loadedEndTime   = fstEndTime;
+        logTraceSizes();
+        return;
+    }
+
+    startTime   = max(startTime, fstProc.startTime());
+    endTime     = min(endTime, fstEndTime);
+    windowSize  = endTime - startTime + 1;
+
+    LOG_INFO("Loading time window [%ld, %ld]", startTime, endTime);
+
+    if (startTime > fstProc.startTime()){
+        init();
+
+        // Only the last write to each location before the window matters. 
+        RegFileTrace seedRegFileTrace(fstProc, regFileTrace.clk, regFileTrace.memWr, regFileTrace.memAddr, regFileTrace.memWrData);
+        MemTrace     seedMemTrace(fstProc, "", 0,
+                                  memTrace.clk,
+                                  memTrace.memCmdValid, memTrace.memCmdReady, memTrace.memCmdAddr, memTrace.memCmdSize, memTrace.memCmdWr, memTrace.memCmdWrData,
+                                  memTrace.memRspValid, memTrace.memRspData);
+        seedRegFileTrace.clkSampler = regFileTrace.clkSampler;
+        seedMemTrace.clkSampler     = memTrace.clkSampler;
+
+        decodeSlices(fstProc.startTime(), startTime-1, nullptr, seedRegFileTrace, seedMemTrace);
+
+        regFileTrace.appendLastWrites(seedRegFileTrace);
+        memTrace.appendLastWrites(seedMemTrace);
+    }
+
+    decode(startTime, endTime);
+    loadedEndTime   = endTime;
+
+    logTraceSizes();
+}
+
+// Reopen the FST file to check if the simulator has completed more value change sections.
+bool TraceLoader::refresh()
+{
+    if (fstComplete)
+        return false;
+
+    // Check for completion first: whatever was written before completion is picked up
+    // by the reopened file.
+    fstComplete = fstProc.isComplete();
+
+    uint64_t liveEndTime;
+    try{
+        FstProcess liveFstProc(fstProc.fstFileName);
+        liveEndTime = liveFstProc.endTime();
+    }
+    catch(runtime_error &e){
+        LOG_WARNING("%s", e.what());
+        return false;
+    }
+
+    if (liveEndTime <= fstEndTime)
+        return false;
+
+    fstEndTime  = liveEndTime;
+    memTrace.updateDuration(fstEndTime - fstProc.startTime());
+
+    return true;
+}
+
+bool TraceLoader::loadNextWindow()
+{
+    // Windows are decoded for all extractors at once.
+    finishBackgroundDecodes();
+
+    if (fullyLoaded() && !(followMode && refresh()))
+        return false;
+
+    uint64_t startTime  = loadedEndTime + 1;
+    uint64_t endTime    = windowSize ? min(loadedEndTime + windowSize, fstEndTime) : fstEndTime;
+
+    LOG_INFO("Loading time window [%ld, %ld]", startTime, endTime);
+
+    decode(startTime, endTime);
+    loadedEndTime   = endTime;
+
+    logTraceSizes();
+
+    return true;
+}
+
+// Decide how the decode is split over nrThreads threads. Each value change section is 
+// compressed independently, so there is no point in having more time slices than sections. 
+// When there are enough threads, each extractor decodes each time slice on its own thread.
+void TraceLoader::planSlices(uint64_t nrExtractors, uint64_t *nrSlices, bool *perExtractor)
+{
+    *perExtractor   = (uint64_t)nrThreads >= nrExtractors;
+    *nrSlices       = *perExtractor ? nrThreads / nrExtractors : nrThreads;
+    *nrSlices       = max(min(*nrSlices, fstProc.valueChangeSectionCount()), (uint64_t)1);
+}
+
+void TraceLoader::decode(uint64_t startTime, uint64_t endTime)
+{
+    init();
+
+    uint64_t    nrSlices;
+    bool        perExtractor;
+    planSlices(3, &nrSlices, &perExtractor);
+
+    // In follow mode, the reader context of fstProc doesn't know about the value change 
+    // sections that were added after it was opened. The slices always open the file again.
+    if (nrSlices == 1 && !perExtractor && !followMode){
+        // All extractors have registered their signals: decode the FST file in one pass.
+        fstProc.setTimeRange(startTime, endTime);
+        fstProc.processValueChanges();
+        cpuTrace.finish(endTime);
+        regFileTrace.finish(endTime);
+        memTrace.finish(endTime);
+        fstProc.clrTimeRange();
+        return;
+    }
+
+    decodeSlices(startTime, endTime, &cpuTrace, regFileTrace, memTrace);
+}
+
+struct TraceSlice {
+    uint64_t                    startTime;
+    uint64_t                    endTime;
+    size_t                      sliceNr;
+
+    // Only used by the background decodes.
+    TraceLoader *               loader;
+    TraceLoader::Subsystem      subsystem;
+    bool                        done;
+
+    // One FST reader context for each thread that decodes the slice.
+    unique_ptr<FstProcess>      fstProcs[3];
+
+    unique_ptr<CpuTrace>        cpuTrace;
+    unique_ptr<RegFileTrace>    regFileTrace;
+    unique_ptr<MemTrace>        memTrace;
+};
+
+// Split [startTime, endTime] in at most nrSlices slices. Each slice but the last ends where 
+// a value change section ends: the FST library starts at the first section that ends in the 
+// time range, so a slice doesn't decode the value changes of a section of the slice before.
+// The sections are divided so that each slice gets about the same number of compressed bytes. 
+// When there are fewer sections than slices, there are fewer slices. When the sections 
+// aren't known, the time range is split evenly.
+void TraceLoader::planSliceTimes(uint64_t startTime, uint64_t endTime, uint64_t nrSlices, vector<TraceSlice> &slices)
+{
+    vector<uint64_t>    sliceStarts = { startTime };
+    vector<WaveSection> sections;
+
+    if (fstProc.valueChangeSections(sections)){
+        uint64_t totalLength = 0;
+        for(auto &section: sections){
+            if (section.endTime >= startTime && section.startTime <= endTime){
+                totalLength += section.length;
+            }
+        }
+
+        uint64_t length = 0;
+        for(auto &section: sections){
+            if (sliceStarts.size() == nrSlices)
+                break;
+            if (section.endTime < startTime || section.startTime > endTime)
+                continue;
+
+            length += section.length;
+            if (length * nrSlices >= totalLength * sliceStarts.size() && section.endTime < endTime && section.endTime >= sliceStarts.back()){
+                sliceStarts.push_back(section.endTime + 1);
+            }
+        }
+    }
+    else{
+        uint64_t duration = endTime - startTime + 1;
+        for(uint64_t i=1;i<nrSlices;++i){
+            sliceStarts.push_back(startTime + duration * i / nrSlices);
+        }
+    }
+
+    slices.resize(sliceStarts.size());
+    for(size_t i=0;i<slices.size();++i){
+        slices[i].startTime = sliceStarts[i];
+        slices[i].endTime   = i+1 < slices.size() ? sliceStarts[i+1] - 1 : endTime;
+        slices[i].sliceNr   = i;
+    }
+}
+
+// Create the slice traces for the extractors of which a trace is given, on a new FST reader 
+// context. The given traces only provide the signals and settings of the slice traces.
+void TraceLoader::initSlice(TraceSlice &slice, int ctxNr, CpuTrace *cpuTrace, RegFileTrace *regFileTrace, MemTrace *memTrace)
+{
+    slice.fstProcs[ctxNr].reset(new FstProcess(fstProc.fstFileName));
+
+    FstProcess &sliceFstProc = *slice.fstProcs[ctxNr];
+    sliceFstProc.setTimeRange(slice.startTime, slice.endTime);
+
+    if (cpuTrace){
+        slice.cpuTrace.reset(new CpuTrace(sliceFstProc, cpuTrace->clk, cpuTrace->pcValid, cpuTrace->pc));
+        slice.cpuTrace->clkSampler = cpuTrace->clkSampler;
+        if (cpuTrace->pcTrace.branchMode){
+            slice.cpuTrace->pcTrace.setBranchMode(cpuTrace->pcTrace.codeImage, cpuTrace->pcTrace.codeImageStart);
+        }
+        slice.cpuTrace->init();
+    }
+
+    if (regFileTrace){
+        slice.regFileTrace.reset(new RegFileTrace(sliceFstProc, regFileTrace->clk, regFileTrace->memWr, regFileTrace->memAddr, regFileTrace->memWrData));
+        slice.regFileTrace->clkSampler = regFileTrace->clkSampler;
+        slice.regFileTrace->init();
+    }
+
+    if (memTrace){
+        slice.memTrace.reset(new MemTrace(sliceFstProc, "", 0, 
+                                          memTrace->clk,
+                                          memTrace->memCmdValid, memTrace->memCmdReady, memTrace->memCmdAddr, memTrace->memCmdSize, memTrace->memCmdWr, memTrace->memCmdWrData,
+                                          memTrace->memRspValid, memTrace->memRspData));
+        slice.memTrace->clkSampler = memTrace->clkSampler;
+        slice.memTrace->init();
+
+        // The first slice continues where the trace ends. The reads that are pending at the 
+        // start of a later slice are only known once the slices before it are done.
+        if (slice.sliceNr == 0){
+            slice.memTrace->pendingReads        = memTrace->pendingReads;
+            slice.memTrace->mergeLastValues(*memTrace);
+        }
+        else{
+            slice.memTrace->pendingReadsKnown   = false;
+        }
+    }
+}
+
+void TraceLoader::decodeSlice(TraceSlice &slice, int ctxNr, CpuTrace *cpuTrace, RegFileTrace *regFileTrace, MemTrace *memTrace)
+{
+    initSlice(slice, ctxNr, cpuTrace, regFileTrace, memTrace);
+
+    slice.fstProcs[ctxNr]->processValueChanges();
+
+    if (cpuTrace){
+        slice.cpuTrace->finish(slice.endTime);
+    }
+    if (regFileTrace){
+        slice.regFileTrace->finish(slice.endTime);
+    }
+    if (memTrace){
+        slice.memTrace->finish(slice.endTime);
+    }
+}
+
+// Split [startTime, endTime] in time slices and decode each slice on its own thread, with its
+// own FST reader context. When there are enough threads, the extractors of a slice each get 
+// their own thread and reader context too. The extractors are independent, so this gives 
+// the same result as decoding them together.
+// The slices are appended to the given traces in time order. The CPU trace is optional.
+void TraceLoader::decodeSlices(uint64_t startTime, uint64_t endTime, CpuTrace *cpuTrace, RegFileTrace &regFileTrace, MemTrace &memTrace)
+{
+    uint64_t    nrSlices;
+    bool        perExtractor;
+    planSlices(cpuTrace ? 3 : 2, &nrSlices, &perExtractor);
+
+    vector<TraceSlice>  slices;
+    vector<thread>      threads;
+
+    planSliceTimes(startTime, endTime, nrSlices, slices);
+
+    if (slices.size() > 1 || perExtractor){
+        LOG_INFO("Decoding %ld time slice(s) in parallel%s...", slices.size(), perExtractor ? ", with one thread per extractor" : "");
+    }
+
+    for(auto &slice: slices){
+        if (perExtractor){
+            if (cpuTrace){
+                threads.push_back(thread(&TraceLoader::decodeSlice, this, ref(slice), 0, cpuTrace, nullptr, nullptr));
+            }
+            threads.push_back(thread(&TraceLoader::decodeSlice, this, ref(slice), 1, nullptr, &regFileTrace, nullptr));
+            threads.push_back(thread(&TraceLoader::decodeSlice, this, ref(slice), 2, nullptr, nullptr, &memTrace));
+        }
+        else{
+            threads.push_back(thread(&TraceLoader::decodeSlice, this, ref(slice), 0, cpuTrace, &regFileTrace, &memTrace));
+        }
+    }
+
+    for(auto &t: threads){
+        t.join();
+    }
+
+    for(auto &slice: slices){
+        if (cpuTrace){
+            cpuTrace->append(*slice.cpuTrace);
+        }
+        regFileTrace.append(*slice.regFileTrace);
+        memTrace.append(*slice.memTrace);
+    }
+}
+
+// Number of times a background slice adds its records to the traces while it is decoded.
+#define NR_PROGRESS_STEPS   256
+
+// Start the background decode of the trace of subsystem, if it hasn't been started yet.
+// Must be called with traceMutex locked.
+void TraceLoader::startDecode(Subsystem subsystem)
+{
+    BackgroundDecode &decode = decodes[subsystem];
+    if (decode.started)
+        return;
+
+    decode.started      = true;
+    decode.loading      = true;
+    decode.loaderThread = thread(&TraceLoader::backgroundDecode, this, subsystem);
+}
+
+// True while a background decode is running, or will be started: the CPU decode starts 
+// the others when it's done. Must be called with traceMutex locked.
+bool TraceLoader::backgroundLoading()
+{
+    if (!background || cancelled)
+        return false;
+
+    for(auto &decode: decodes){
+        if (!decode.started || decode.loading)
+            return true;
+    }
+
+    return false;
+}
+
+// Decode the trace of subsystem over the full time range in time slices, like decodeSlices(). 
+// The records of each slice are added to the trace while it is being decoded, as soon as all 
+// earlier slices are done.
+void TraceLoader::backgroundDecode(Subsystem subsystem)
+{
+    BackgroundDecode &decode = decodes[subsystem];
+
+    uint64_t    nrSlices;
+    bool        perExtractor;
+    planSlices(1, &nrSlices, &perExtractor);
+
+    vector<TraceSlice>  slices;
+    vector<thread>      threads;
+
+    planSliceTimes(fstProc.startTime(), fstEndTime, nrSlices, slices);
+
+    {
+        lock_guard<mutex> lock(traceMutex);
+        decode.slices       = &slices;
+        decode.nextSlice    = 0;
+    }
+
+    for(auto &slice: slices){
+        slice.loader    = this;
+        slice.subsystem = subsystem;
+        slice.done      = false;
+
+        threads.push_back(thread([this, &slice](){
+            initSlice(slice, 0, slice.subsystem == CPU      ? &cpuTrace     : nullptr, 
+                                slice.subsystem == REG_FILE ? &regFileTrace : nullptr, 
+                                slice.subsystem == MEM      ? &memTrace     : nullptr);
+
+            FstProcess &sliceFstProc = *slice.fstProcs[0];
+            sliceFstProc.setProgressHandler(sliceProgressCB, &slice, (slice.endTime - slice.startTime) / NR_PROGRESS_STEPS);
+            if (!cancelled){
+                sliceFstProc.processValueChanges();
+            }
+
+            if (!cancelled){
+                publishSlice(slice, slice.endTime, true);
+            }
+        }));
+    }
+
+    for(auto &t: threads){
+        t.join();
+    }
+
+    {
+        lock_guard<mutex> lock(traceMutex);
+        decode.slices   = nullptr;
+
+        // Nobody asked for them yet, but they will probably be needed.
+        if (subsystem == CPU && !cancelled){
+            startDecode(REG_FILE);
+            startDecode(MEM);
+        }
+    }
+
+    saveWhenLoaded();
+}
+
+// Save the traces to the cache file once all background decodes are done.
+void TraceLoader::saveWhenLoaded()
+{
+    {
+        lock_guard<mutex> lock(traceMutex);
+        for(auto &decode: decodes){
+            if (!decode.started || decode.loading)
+                return;
+        }
+
+        if (cacheSaved)
+            return;
+        cacheSaved = true;
+    }
+
+    logTraceSizes();
+
+    if (traceCache){
+        traceCache->save(cpuTrace, regFileTrace, memTrace);
+    }
+}
+
+// Complete all background decodes, so that the traces can be extended by decode() again.
+// The stub only loads the next window once isLoading() is false, after waiting for the 
+// background decodes while it checks for interrupts, so this doesn't block anymore then.
+void TraceLoader::finishBackgroundDecodes()
+{
+    if (!background)
+        return;
+
+    waitForTrace(REG_FILE, fstEndTime);
+    waitForTrace(MEM, fstEndTime);
+
+    for(auto &decode: decodes){
+        if (decode.loaderThread.joinable()){
+            decode.loaderThread.join();
+        }
+    }
+
+    background  = false;
+}
+
+void TraceLoader::sliceProgressCB(uint64_t time, void *userInfo)
+{
+    TraceSlice *slice = (TraceSlice *)userInfo;
+
+    if (slice->loader->cancelled){
+        slice->fstProcs[0]->stopValueChanges();
+        return;
+    }
+
+    // Nothing is complete yet before the first time stamp.
+    if (time == 0)
+        return;
+
+    slice->loader->publishSlice(*slice, time-1, false);
+}
+
+// All records of the slice up to frontier are complete. Add them to the trace when 
+// the slice is the oldest one that hasn't been fully added yet.
+void TraceLoader::publishSlice(TraceSlice &slice, uint64_t frontier, bool done)
+{
+    frontier = min(frontier, slice.endTime);
+
+    if (slice.cpuTrace){
+        slice.cpuTrace->finish(frontier);
+    }
+    if (slice.regFileTrace){
+        slice.regFileTrace->finish(frontier);
+    }
+    if (slice.memTrace){
+        slice.memTrace->finish(frontier);
+    }
+
+    lock_guard<mutex> lock(traceMutex);
+
+    BackgroundDecode &decode = decodes[slice.subsystem];
+
+    slice.done = done;
+    if (slice.sliceNr != decode.nextSlice)
+        return;
+
+    moveSliceRecords(slice);
+    decode.loadedUntil = max(decode.loadedUntil, frontier+1);
+
+    // Later slices that are already done were waiting for this one.
+    while(done && ++decode.nextSlice < decode.slices->size()){
+        TraceSlice &nextSlice = (*decode.slices)[decode.nextSlice];
+        if (!nextSlice.done)
+            break;
+
+        moveSliceRecords(nextSlice);
+        decode.loadedUntil = nextSlice.endTime+1;
+    }
+
+    if (decode.nextSlice == decode.slices->size()){
+        decode.loading = false;
+    }
+
+    if (slice.subsystem == CPU){
+        loadedEndTime = decode.loadedUntil-1;
+    }
+
+    traceChanged.notify_all();
+}
+
+void TraceLoader::moveSliceRecords(TraceSlice &slice)
+{
+    if (slice.cpuTrace){
+        cpuTrace.append(*slice.cpuTrace);
+    }
+    if (slice.regFileTrace){
+        regFileTrace.append(*slice.regFileTrace);
+    }
+    if (slice.memTrace){
+        memTrace.append(*slice.memTrace);
+    }
+}
@@ -0,0 +1,130 @@
+#ifndef TRACE_LOADER_H
+#define TRACE_LOADER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "FstProcess.h"
+#include "CpuTrace.h"
+#include "RegFileTrace.h"
+#include "MemTrace.h"
+#include "TraceCache.h"
+
+struct TraceSlice;
+
+// Fills the CPU, register file and memory traces: from the cache file when possible, 
+// otherwise by decoding the FST file, either completely or one time window at a time.
+//
+// A complete decode runs on background threads: the traces grow while GDB is being 
+// served, so they must only be accessed with traceMutex locked. Only the CPU trace is 
+// decoded right away. The register file and memory traces are decoded when they are first 
+// needed, or once the CPU trace is done.
+class TraceLoader
+{
+public:
+    // The parts of the trace that are decoded independently in the background.
+    enum Subsystem { CPU, REG_FILE, MEM, NR_SUBSYSTEMS };
+
+    TraceLoader(FstProcess & fstProc, CpuTrace & cpuTrace, RegFileTrace & regFileTrace, MemTrace & memTrace, 
+                TraceCache * traceCache, int nrThreads, bool followMode);
+    ~TraceLoader();
+
+    // Load the full trace. When it isn't in the cache file, the FST file is decoded in the 
+    // background and load() returns immediately.
+    void load();
+
+    // True while any trace is decoded in the background. loadNextWindow() can only extend 
+    // the traces once all background decodes are done, so it must not be called before.
+    bool isLoading();
+
+    // Returns true when the instruction with index pcTraceIdx has been loaded.
+    bool pcLoaded(size_t pcTraceIdx);
+
+    // Wait for the background decodes to add to the traces, for at most timeoutMs.
+    void waitForProgress(int timeoutMs);
+
+    // Wait until the trace of subsystem contains all records up to time. Starts the 
+    // background decode of the trace when it hasn't been started yet.
+    void waitForTrace(Subsystem subsystem, uint64_t time);
+
+    // Only load [startTime, endTime]. The register file and memory state at startTime is seeded 
+    // with the last write to each register and memory location before startTime. 
+    // Windows of the same size that follow are loaded on demand with loadNextWindow().
+    void loadWindow(uint64_t startTime, uint64_t endTime);
+
+    // Load the next window. Returns false when the end of the FST file has been reached.
+    // In follow mode, the end of the FST file is the last value change section that 
+    // the simulator has completed so far.
+    bool loadNextWindow();
+
+    bool fullyLoaded()      { return loadedEndTime >= fstEndTime; };
+
+    // True when in follow mode and the simulator is still writing the FST file: more 
+    // value change sections may appear later.
+    bool isLive()           { return followMode && !fstComplete; };
+
+    FstProcess &    fstProc;
+    CpuTrace &      cpuTrace;
+    RegFileTrace &  regFileTrace;
+    MemTrace &      memTrace;
+    TraceCache *    traceCache;
+    int             nrThreads;
+    bool            followMode;
+
+    bool            initialized;
+    bool            fstComplete;
+    uint64_t        fstEndTime;
+    uint64_t        windowSize;
+    uint64_t        loadedEndTime;
+
+    mutex               traceMutex;
+    condition_variable  traceChanged;
+
+private:
+    struct BackgroundDecode {
+        bool                    started;
+        bool                    loading;
+        thread                  loaderThread;
+
+        // The slices are decoded in parallel, but their records are only added to the 
+        // traces in time order.
+        vector<TraceSlice> *    slices;
+        size_t                  nextSlice;
+
+        // All records before this time have been added to the trace.
+        uint64_t                loadedUntil;
+    };
+
+    // True when the traces are decoded in the background instead of by load().
+    bool                    background;
+    bool                    cacheSaved;
+    BackgroundDecode        decodes[NR_SUBSYSTEMS];
+
+    // Set when the loader is destroyed: the background decodes stop at their next 
+    // progress step, without adding anything to the traces.
+    atomic<bool>            cancelled;
+
+    void startDecode(Subsystem subsystem);
+    bool backgroundLoading();
+    void backgroundDecode(Subsystem subsystem);
+    void finishBackgroundDecodes();
+    void saveWhenLoaded();
+    static void sliceProgressCB(uint64_t time, void *userInfo);
+    void publishSlice(TraceSlice &slice, uint64_t frontier, bool done);
+    void moveSliceRecords(TraceSlice &slice);
+
+    void init();
+    bool refresh();
+    void decode(uint64_t startTime, uint64_t endTime);
+    void planSlices(uint64_t nrExtractors, uint64_t *nrSlices, bool *perExtractor);
+    void planSliceTimes(uint64_t startTime, uint64_t endTime, uint64_t nrSlices, vector<TraceSlice> &slices);
+    void initSlice(TraceSlice &slice, int ctxNr, CpuTrace *cpuTrace, RegFileTrace *regFileTrace, MemTrace *memTrace);
+    void decodeSlice(TraceSlice &slice, int ctxNr, CpuTrace *cpuTrace, RegFileTrace *regFileTrace, MemTrace *memTrace);
+    void decodeSlices(uint64_t startTime, uint64_t endTime, CpuTrace *cpuTrace, RegFileTrace &regFileTrace, MemTrace &memTrace);
+    void logTraceSizes();
+};
+
+#endif
@@ -0,0 +1,385 @@
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "VcdReader.h"
+#include "Logger.h"
+
+static inline const char *skipSpace(const char *p, const char *end)
+{
+    while(p < end && (unsigned char)*p <= ' ')
+        ++p;
+    return p;
+}
+
+// Return a pointer to the first whitespace character at or after p. VCD tokens only
+// contain printable characters, so 8 characters are checked at a time for one that is
+// smaller than '!'.
+static inline const char *tokenEnd(const char *p, const char *end)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while(p+8 <= end){
+        uint64_t chars;
+        memcpy(&chars, p, 8);
+
+        uint64_t spaces = (chars - 0x2121212121212121ULL) & ~chars & 0x8080808080808080ULL;
+        if (spaces){
+            return p + (__builtin_ctzll(spaces) >> 3);
+        }
+        p += 8;
+    }
+#endif
+
+    while(p < end && (unsigned char)*p > ' ')
+        ++p;
+    return p;
+}
+
+// Identifier codes of up to 8 characters are looked up as an integer.
+static inline uint64_t packIdCode(const char *idCode, size_t len)
+{
+    uint64_t packed = 0;
+    memcpy(&packed, idCode, len);
+    return packed;
+}
+
+static string joinTokens(vector<string> &tokens, string separator)
+{
+    string s;
+    for(auto &t: tokens){
+        if (!s.empty())
+            s += separator;
+        s += t;
+    }
+    return s;
+}
+
+VcdReader::VcdReader(string vcdFileName) :
+    vcdTimescale(0),
+    vcdStartTime(0),
+    vcdEndTime(0),
+    vcdScopeCount(0),
+    vcdMaxHandle(0),
+    vcdFileName(vcdFileName),
+    data(nullptr),
+    size(0),
+    bodyStart(nullptr),
+    timeRangeValid(false),
+    timeRangeStart(0),
+    timeRangeEnd(0),
+    resumeValid(false),
+    resumePos(nullptr),
+    resumeAfterTime(0)
+{
+    int fd = open(vcdFileName.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0){
+        if (fd >= 0)
+            close(fd);
+
+        stringstream ss;
+        ss << "Could not open file '" << vcdFileName << "'";
+        throw runtime_error(ss.str());
+    }
+
+    size = st.st_size;
+    void *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED){
+        stringstream ss;
+        ss << "Could not map file '" << vcdFileName << "'";
+        throw runtime_error(ss.str());
+    }
+
+    data = (const char *)base;
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    parseHeader();
+    findEndTime();
+
+    processMask.resize(vcdMaxHandle+1, false);
+}
+
+VcdReader::~VcdReader()
+{
+    munmap((void *)data, size);
+}
+
+bool VcdReader::isVcdFile(string fileName)
+{
+    ifstream f(fileName, ios::in | ios::binary);
+
+    char c;
+    while(f.get(c)){
+        if ((unsigned char)c > ' ')
+            return c == '$';
+    }
+
+    return false;
+}
+
+void VcdReader::parseHeader()
+{
+    const char *p   = data;
+    const char *end = data + size;
+
+    auto nextToken = [&](string &token) -> bool {
+        p = skipSpace(p, end);
+        if (p == end)
+            return false;
+
+        const char *e = tokenEnd(p, end);
+        token.assign(p, e-p);
+        p = e;
+        return true;
+    };
+
+    vector<string>  scopes;
+    string          curScopeName;
+
+    unordered_map<string, uint32_t> idCodeHandles;
+    handleIdCodes.push_back("");
+
+    string          keyword;
+    string          token;
+    vector<string>  args;
+
+    while(nextToken(keyword)){
+        if (keyword[0] != '$'){
+            stringstream ss;
+            ss << "Unexpected '" << keyword << "' in header of VCD file '" << vcdFileName << "'";
+            throw runtime_error(ss.str());
+        }
+
+        args.clear();
+        while(nextToken(token) && token != "$end"){
+            args.push_back(token);
+        }
+
+        if (keyword == "$enddefinitions"){
+            bodyStart = p;
+            break;
+        }
+        else if (keyword == "$scope" && args.size() >= 2){
+            scopes.push_back(args[1]);
+            curScopeName = joinTokens(scopes, ".");
+            ++vcdScopeCount;
+        }
+        else if (keyword == "$upscope" && !scopes.empty()){
+            scopes.pop_back();
+            curScopeName = joinTokens(scopes, ".");
+        }
+        else if (keyword == "$var" && args.size() >= 4){
+            // $var <type> <size> <identifier code> <reference> [<bit range>] $end
+            auto it = idCodeHandles.find(args[2]);
+            if (it == idCodeHandles.end()){
+                it = idCodeHandles.emplace(args[2], ++vcdMaxHandle).first;
+                handleIdCodes.push_back(args[2]);
+            }
+
+            vars.push_back(VcdVar{ curScopeName + "." + args[3], it->second, (uint32_t)stoul(args[1]) });
+        }
+        else if (keyword == "$timescale"){
+            // 1, 10 or 100 followed by s, ms, us, ns, ps or fs, with or without a space.
+            string ts = joinTokens(args, "");
+            size_t unitPos = ts.find_first_not_of("0123456789");
+            if (unitPos != string::npos){
+                vcdTimescale = unitPos - 1;
+
+                string unit = ts.substr(unitPos);
+                if      (unit == "ms") vcdTimescale -= 3;
+                else if (unit == "us") vcdTimescale -= 6;
+                else if (unit == "ns") vcdTimescale -= 9;
+                else if (unit == "ps") vcdTimescale -= 12;
+                else if (unit == "fs") vcdTimescale -= 15;
+            }
+        }
+        else if (keyword == "$version"){
+            vcdVersion = joinTokens(args, " ");
+        }
+        else if (keyword == "$date"){
+            vcdDate = joinTokens(args, " ");
+        }
+    }
+
+    if (bodyStart == nullptr){
+        stringstream ss;
+        ss << "No $enddefinitions in VCD file '" << vcdFileName << "'";
+        throw runtime_error(ss.str());
+    }
+
+    // The start time is the first time stamp.
+    while(nextToken(token)){
+        if (token[0] == '#'){
+            vcdStartTime = stoull(token.substr(1));
+            break;
+        }
+    }
+}
+
+// The end time is the last time stamp of the file. It is found by searching backwards
+// for a line that starts with '#'.
+void VcdReader::findEndTime()
+{
+    vcdEndTime = vcdStartTime;
+
+    for(const char *p = data + size - 1; p > bodyStart; --p){
+        if (*p == '#' && p[-1] == '\n' && p+1 < data+size && isdigit(p[1])){
+            uint64_t time = 0;
+            for(++p; p < data+size && isdigit(*p); ++p){
+                time = time * 10 + (*p - '0');
+            }
+            vcdEndTime = time;
+            return;
+        }
+    }
+}
+
+void VcdReader::addInfo(stringstream &ss)
+{
+    ss << "VCD file: " << vcdFileName << endl;
+}
+
+void VcdReader::forEachVar(VarCB cb)
+{
+    for(auto &var: vars){
+        cb(var.fullName, var.handle, var.length);
+    }
+}
+
+void VcdReader::setProcessMask(uint32_t handle)
+{
+    processMask[handle] = true;
+    resumeValid = false;
+}
+
+void VcdReader::clrProcessMaskAll()
+{
+    fill(processMask.begin(), processMask.end(), false);
+    resumeValid = false;
+}
+
+void VcdReader::setLimitTimeRange(uint64_t start, uint64_t end)
+{
+    timeRangeValid  = true;
+    timeRangeStart  = start;
+    timeRangeEnd    = end;
+}
+
+void VcdReader::setUnlimitedTimeRange()
+{
+    timeRangeValid  = false;
+}
+
+// Walk the value changes and call cb for each change of a signal in the process mask.
+// Identifier codes are matched against the selected signals only, and the values of
+// other signals are skipped without being parsed.
+void VcdReader::iterValueChanges(FixedValueChangeCB fixedCb, ValueChangeCB cb, void *userData)
+{
+    unordered_map<uint64_t, uint32_t>   shortIdCodes;
+    unordered_map<string, uint32_t>     longIdCodes;
+
+    for(uint32_t handle=1;handle<=vcdMaxHandle;++handle){
+        if (!processMask[handle])
+            continue;
+
+        string &idCode = handleIdCodes[handle];
+        if (idCode.size() <= 8){
+            shortIdCodes[packIdCode(idCode.data(), idCode.size())] = handle;
+        }
+        else{
+            longIdCodes[idCode] = handle;
+        }
+    }
+
+    auto lookup = [&](const char *idCode, const char *idCodeEnd) -> uint32_t {
+        size_t len = idCodeEnd - idCode;
+        if (len <= 8){
+            auto it = shortIdCodes.find(packIdCode(idCode, len));
+            return it == shortIdCodes.end() ? 0 : it->second;
+        }
+        auto it = longIdCodes.find(string(idCode, len));
+        return it == longIdCodes.end() ? 0 : it->second;
+    };
+
+    const char *p   = bodyStart;
+    const char *end = data + size;
+    uint64_t time   = 0;
+
+    if (timeRangeValid && resumeValid && timeRangeStart > resumeAfterTime){
+        p = resumePos;
+    }
+    resumeValid = false;
+
+    while(true){
+        p = skipSpace(p, end);
+        if (p == end)
+            break;
+
+        const char *tokEnd = tokenEnd(p, end);
+
+        switch(*p){
+            case '#': {
+                uint64_t t = 0;
+                for(const char *d=p+1;d<tokEnd;++d){
+                    t = t * 10 + (*d - '0');
+                }
+
+                if (timeRangeValid && t > timeRangeEnd){
+                    resumeValid     = true;
+                    resumePos       = p;
+                    resumeAfterTime = timeRangeEnd;
+                    return;
+                }
+                time = t;
+                break;
+            }
+            case '0': case '1': case 'x': case 'X': case 'z': case 'Z': {
+                // Scalar: the identifier code directly follows the value.
+                uint32_t handle = lookup(p+1, tokEnd);
+                if (handle){
+                    cb(userData, time, handle, (const unsigned char *)p, 1);
+                }
+                break;
+            }
+            case 'b': case 'B': case 'r': case 'R': {
+                // Vector or real: the identifier code is the next token.
+                const char *idCode      = skipSpace(tokEnd, end);
+                const char *idCodeEnd   = tokenEnd(idCode, end);
+
+                uint32_t handle = lookup(idCode, idCodeEnd);
+                if (handle){
+                    cb(userData, time, handle, (const unsigned char *)p+1, tokEnd-p-1);
+                }
+                tokEnd = idCodeEnd;
+                break;
+            }
+            case '$': {
+                // $dumpvars, $dumpall etc. only group value changes, but the text
+                // of a $comment must be skipped.
+                if (tokEnd-p == 8 && memcmp(p, "$comment", 8) == 0){
+                    do{
+                        p       = skipSpace(tokEnd, end);
+                        tokEnd  = tokenEnd(p, end);
+                    } while(p != end && !(tokEnd-p == 4 && memcmp(p, "$end", 4) == 0));
+                }
+                break;
+            }
+        }
+
+        p = tokEnd;
+    }
+
+    if (timeRangeValid){
+        resumeValid     = true;
+        resumePos       = end;
+        resumeAfterTime = timeRangeEnd;
+    }
+}
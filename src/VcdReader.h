@@ -0,0 +1,100 @@
+#ifndef VCD_READER_H
+#define VCD_READER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#include "WaveReader.h"
+
+using namespace std;
+
+// Reads VCD files. The file is memory mapped. Value changes of signals that are not 
+// selected are skipped without looking at the value.
+class VcdReader : public WaveReader
+{
+public:
+    VcdReader(string vcdFileName);
+    ~VcdReader();
+
+    // Returns true when the file looks like a VCD file: VCD files start with a keyword.
+    static bool isVcdFile(string fileName);
+
+    string      version()                   { return vcdVersion; };
+    string      date()                      { return vcdDate; };
+    uint64_t    aliasCount()                { return vars.size() - vcdMaxHandle; };
+    uint64_t    startTime()                 { return vcdStartTime; };
+    uint64_t    endTime()                   { return vcdEndTime; };
+    int64_t     timezero()                  { return 0; };
+    uint64_t    scopeCount()                { return vcdScopeCount; };
+    int         timescale()                 { return vcdTimescale; };
+    uint64_t    varCount()                  { return vars.size(); };
+    uint64_t    valueChangeSectionCount()   { return 1; };
+    uint32_t    maxHandle()                 { return vcdMaxHandle; };
+
+    void        addInfo(stringstream &ss);
+
+    // VCD files are only read once they are complete.
+    bool        isComplete()                { return true; };
+
+    // A VCD file can only be walked from the start.
+    bool        valueChangeSections(vector<WaveSection> &sections)  { sections.clear(); return false; };
+
+    void        forEachVar(VarCB cb);
+
+    void        setProcessMask(uint32_t handle);
+    void        clrProcessMaskAll();
+
+    // Like the FST library, value changes before start are still sent to the callback.
+    void        setLimitTimeRange(uint64_t start, uint64_t end);
+    void        setUnlimitedTimeRange();
+
+    // All values are sent to cb, with their length.
+    void        iterValueChanges(FixedValueChangeCB fixedCb, ValueChangeCB cb, void *userData);
+
+private:
+    struct VcdVar {
+        string      fullName;
+        uint32_t    handle;
+        uint32_t    length;
+    };
+
+    string          vcdVersion;
+    string          vcdDate;
+    int             vcdTimescale;
+    uint64_t        vcdStartTime;
+    uint64_t        vcdEndTime;
+    uint64_t        vcdScopeCount;
+
+    // All variables, in the order in which they were declared. Variables that share an
+    // identifier code share the same handle. Handles start at 1, like fstHandles.
+    vector<VcdVar>  vars;
+    uint32_t        vcdMaxHandle;
+
+    string          vcdFileName;
+    const char *    data;
+    size_t          size;
+
+    // Start of the value changes, right after $enddefinitions $end.
+    const char *    bodyStart;
+
+    vector<string>  handleIdCodes;
+    vector<bool>    processMask;
+
+    bool            timeRangeValid;
+    uint64_t        timeRangeStart;
+    uint64_t        timeRangeEnd;
+
+    // When a time range walk stops at timeRangeEnd, the next walk with a time range that
+    // starts after it continues where the previous one stopped instead of at the start
+    // of the file. This keeps loading a trace one time window at a time linear.
+    bool            resumeValid;
+    const char *    resumePos;
+    uint64_t        resumeAfterTime;
+
+    void parseHeader();
+    void findEndTime();
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef WAVE_READER_H
+#define WAVE_READER_H
+
+#include <stdint.h>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The time range and the size in bytes of a value change section.
+struct WaveSection
+{
+    uint64_t    startTime;
+    uint64_t    endTime;
+    uint64_t    length;
+};
+
+// What FstProcess needs from a waveform file: header information, the variables of the
+// hierarchy, and a walk over the value changes of selected signals. FstReader reads FST
+// files with the FST reader library, VcdReader reads VCD files.
+class WaveReader
+{
+public:
+    virtual ~WaveReader() {}
+
+    // Same arguments as the callbacks of fstReaderIterBlocks2. A fixed length value has
+    // the length of the variable. value is not NUL-terminated.
+    typedef void (*FixedValueChangeCB)(void *userData, uint64_t time, uint32_t handle, const unsigned char *value);
+    typedef void (*ValueChangeCB)(void *userData, uint64_t time, uint32_t handle, const unsigned char *value, uint32_t len);
+
+    typedef function<void(const string &fullName, uint32_t handle, uint32_t length)>    VarCB;
+
+    virtual string      version() = 0;
+    virtual string      date() = 0;
+    virtual uint64_t    aliasCount() = 0;
+    virtual uint64_t    startTime() = 0;
+    virtual uint64_t    endTime() = 0;
+    virtual int64_t     timezero() = 0;
+    virtual uint64_t    scopeCount() = 0;
+    virtual int         timescale() = 0;
+    virtual uint64_t    varCount() = 0;
+    virtual uint64_t    valueChangeSectionCount() = 0;
+
+    // Handles go from 1 to maxHandle().
+    virtual uint32_t    maxHandle() = 0;
+
+    // Add the header information that is specific to the file format to ss.
+    virtual void        addInfo(stringstream &ss) = 0;
+
+    // Returns false while the simulator is still writing the file.
+    virtual bool        isComplete() = 0;
+
+    // List the value change sections that have been completed, in file order. Returns
+    // false when the file has no sections that can be decoded independently.
+    virtual bool        valueChangeSections(vector<WaveSection> &sections) = 0;
+
+    // Call cb with the full path of each variable in the hierarchy, in declaration order.
+    virtual void        forEachVar(VarCB cb) = 0;
+
+    virtual void        setProcessMask(uint32_t handle) = 0;
+    virtual void        clrProcessMaskAll() = 0;
+
+    // Stop walking the value changes after end. Value changes before start may still
+    // be sent to the callbacks.
+    virtual void        setLimitTimeRange(uint64_t start, uint64_t end) = 0;
+    virtual void        setUnlimitedTimeRange() = 0;
+
+    // Call one of the callbacks for each value change of a signal in the process mask.
+    virtual void        iterValueChanges(FixedValueChangeCB fixedCb, ValueChangeCB cb, void *userData) = 0;
+};
+
+#endif
@@ -550,18 +550,15 @@ int dbg_dec_bin(const char *buf, size_t buf_len, char *data, size_t data_len)
 int dbg_mem_read(char *buf, size_t buf_len, address addr, size_t len, dbg_enc_func enc)
 {
 	char data[64];
-	size_t pos;
 
 	if (len > sizeof(data)) {
 		return EOF;
 	}
 
 	/* Read from system memory */
-	for (pos = 0; pos < len; pos++) {
-		if (dbg_sys_mem_readb(addr+pos, &data[pos])) {
-			/* Failed to read */
-			return EOF;
-		}
+	if (dbg_sys_mem_read(addr, data, len)) {
+		/* Failed to read */
+		return EOF;
 	}
 
 	/* Encode data */
@@ -888,6 +885,8 @@ int dbg_main(struct dbg_state *state)
 			LOG_INFO("CMD - g: read registers");
 			LOG_INFO("    PC: 0x%08x", state->registers[DBG_CPU_RISCV_PC]);
 
+			dbg_sys_update_registers();
+
 			/* Encode registers */
 			status = dbg_enc_hex(pkt_buf, sizeof(pkt_buf),
 			                     (char *)&(state->registers),
@@ -937,6 +936,7 @@ int dbg_main(struct dbg_state *state)
 			}
 
 			/* Read Register */
+			dbg_sys_update_registers();
 			status = dbg_enc_hex(pkt_buf, sizeof(pkt_buf),
 			                     (char *)&(state->registers[addr]),
 			                     sizeof(state->registers[addr]));
@@ -76,6 +76,7 @@ int dbg_main(struct dbg_state *state);
 int dbg_sys_getc(void);
 int dbg_sys_putchar(int ch);
 int dbg_sys_mem_readb(address addr, char *val);
+int dbg_sys_mem_read(address addr, char *data, size_t len);
 int dbg_sys_mem_writeb(address addr, char val);
 int dbg_sys_continue();
 int dbg_sys_step();
@@ -9,6 +9,7 @@
 #include "gdbstub_sys.h"
 
 static TcpServer    *tcpServer;
+static TraceLoader  *traceLoader;
 static CpuTrace     *cpuTrace;
 static RegFileTrace *regFileTrace;
 static MemTrace     *memTrace;
@@ -17,19 +18,50 @@ static struct dbg_state dbg_state;
 
 static map<address, bool> breakpoints;
 
-void dbg_sys_init(TcpServer &tS, CpuTrace &cT, RegFileTrace &rT, MemTrace &mT)
+// The registers are only looked up when GDB reads them: that's when the register file
+// trace is needed.
+static bool registersValid = false;
+
+// The register file at the instruction where the registers were last looked up. Moving it 
+// to the next instruction only applies the writes in between.
+static RegFileState regFileState = RegFileState();
+
+static bool pcAvailable(size_t pcTraceIdx);
+
+// While the trace is being loaded in the background, the traces grow underneath the stub:
+// always access them with the trace mutex locked.
+static PcValue curPcValue()
+{
+    lock_guard<mutex> lock(traceLoader->traceMutex);
+    return cpuTrace->pcTrace[cpuTrace->pcTraceIdx];
+}
+
+static size_t pcTraceSize()
+{
+    lock_guard<mutex> lock(traceLoader->traceMutex);
+    return cpuTrace->pcTrace.size();
+}
+
+void dbg_sys_init(TcpServer &tS, TraceLoader &tL, CpuTrace &cT, RegFileTrace &rT, MemTrace &mT)
 {
     tcpServer       = &tS;
+    traceLoader     = &tL;
     cpuTrace        = &cT;
     regFileTrace    = &rT;
     memTrace        = &mT;
 
-    cpuTrace->pcTraceIt = cpuTrace->pcTrace.begin();
+    cpuTrace->pcTraceIdx = 0;
 
     for(int i=0;i<32;++i){
         dbg_state.registers[i] = 0xdeadbeef;
     }
 
+    // Registers and the PC can only be reported once the first instruction has been loaded.
+    if (!pcAvailable(0)){
+        LOG_ERROR("No instructions found in trace.");
+        exit(1);
+    }
+
     dbg_sys_update_state();
 
     int ret;
@@ -42,14 +74,32 @@ void dbg_sys_init(TcpServer &tS, CpuTrace &cT, RegFileTrace &rT, MemTrace &mT)
 
 void dbg_sys_update_state()
 {
+    dbg_state.registers[DBG_CPU_RISCV_PC] = curPcValue().pc;
+    registersValid = false;
+}
+
+void dbg_sys_update_registers()
+{
+    if (registersValid)
+        return;
+
+    uint64_t time = curPcValue().time;
+    traceLoader->waitForTrace(TraceLoader::REG_FILE, time);
+
+    lock_guard<mutex> lock(traceLoader->traceMutex);
+
+    regFileTrace->moveState(regFileState, time);
+
     for(int i=0;i<32;++i){
-        uint64_t value;
-        if (regFileTrace->getValue(cpuTrace->pcTraceIt->time, i, &value)){
-            dbg_state.registers[i] = (uint32_t)value;
+        if (regFileState.validMask & (1u << i)){
+            dbg_state.registers[i] = (uint32_t)regFileState.values[i];
+        }
+        else{
+            dbg_state.registers[i] = 0xdeadbeef;
         }
     }
 
-    dbg_state.registers[DBG_CPU_RISCV_PC] = cpuTrace->pcTraceIt->pc;
+    registersValid = true;
 }
 
 
@@ -92,7 +142,16 @@ int dbg_sys_putchar(int ch)
 
 int dbg_sys_mem_readb(address addr, char *val)
 {
-    memTrace->getValue(cpuTrace->pcTraceIt->time, addr, val);
+    return dbg_sys_mem_read(addr, val, 1);
+}
+
+int dbg_sys_mem_read(address addr, char *data, size_t len)
+{
+    uint64_t time = curPcValue().time;
+    traceLoader->waitForTrace(TraceLoader::MEM, time);
+
+    lock_guard<mutex> lock(traceLoader->traceMutex);
+    memTrace->getRange(time, addr, len, data);
     return 0;
 }
 
@@ -103,10 +162,9 @@ int dbg_sys_mem_writeb(address addr, char val)
 
 void print_pc(CpuTrace * cpuTrace)
 {
-    auto t  = cpuTrace->pcTraceIt->time;
-    auto pc = cpuTrace->pcTraceIt->pc;
+    PcValue pcValue = curPcValue();
 
-    LOG_INFO("PC: 0x%08lx @ %ld (%ld/%ld)", pc, t, std::distance(cpuTrace->pcTrace.begin(), cpuTrace->pcTraceIt), cpuTrace->pcTrace.size()-1);
+    LOG_INFO("PC: 0x%08lx @ %ld (%ld/%ld)", pcValue.pc, pcValue.time, cpuTrace->pcTraceIdx, pcTraceSize()-1);
 }
 
 // End of trace conditions are treated differently for step and continue, because
@@ -131,30 +189,99 @@ void print_pc(CpuTrace * cpuTrace)
 // This has the big negative that you can't do anything like 'print' etc anymore, but
 // at least, you can restart the program without losing breakpoints etc.
 
+// How long to wait for the simulator before checking the FST file again in follow mode.
+#define FOLLOW_POLL_MS  500
+
+// How long to wait for the background loader before checking for an interrupt.
+#define LOADING_POLL_MS 50
+
+static bool interrupted = false;
+
+// Wait up to timeoutMs for GDB to send an interrupt (Ctrl-C). Anything else
+// that was received is left for dbg_sys_getc.
+static bool interruptRequested(int timeoutMs)
+{
+    if (rxbuf_cur_idx == rxbuf_len && !tcpServer->dataAvailable(timeoutMs)){
+        return false;
+    }
+
+    int ch = dbg_sys_getc();
+    if (ch == 0x03){
+        LOG_INFO("Interrupted by GDB");
+        return true;
+    }
+
+    if (ch != EOF){
+        --rxbuf_cur_idx;
+    }
+
+    return false;
+}
+
+// Returns true when the instruction with index pcTraceIdx is available. While the trace is 
+// loaded in the background, wait for the loader to get there. When it hasn't been loaded 
+// yet, the next time windows are loaded until it is. In follow mode, wait for the simulator 
+// to write it. Waiting stops when GDB interrupts.
+static bool pcAvailable(size_t pcTraceIdx)
+{
+    interrupted = false;
+
+    while(!traceLoader->pcLoaded(pcTraceIdx)){
+        int pollMs = 0;
+
+        if (traceLoader->isLoading()){
+            traceLoader->waitForProgress(LOADING_POLL_MS);
+        }
+        else if (traceLoader->loadNextWindow()){
+            continue;
+        }
+        else if (traceLoader->isLive()){
+            pollMs = FOLLOW_POLL_MS;
+        }
+        else{
+            // The background loader may have finished since the last check.
+            return traceLoader->pcLoaded(pcTraceIdx);
+        }
+
+        if (interruptRequested(pollMs)){
+            interrupted = true;
+            return false;
+        }
+    }
+
+    return true;
+}
+
 int dbg_sys_continue(void)
 {
-    while(cpuTrace->pcTraceIt != cpuTrace->pcTrace.end()){
-        address curAddr = cpuTrace->pcTraceIt->pc;
+    while(pcAvailable(cpuTrace->pcTraceIdx)){
+        address curAddr = curPcValue().pc;
 
         print_pc(cpuTrace);
 
         auto breakpointIt = breakpoints.find(curAddr);
         if (breakpointIt != breakpoints.end()){
-            LOG_INFO("Hit breakpoint %ld at PC = 0x%08lx", std::distance(breakpoints.begin(), breakpointIt), cpuTrace->pcTraceIt->pc);
+            LOG_INFO("Hit breakpoint %ld at PC = 0x%08x", std::distance(breakpoints.begin(), breakpointIt), curAddr);
             break;
         }
 
-        ++cpuTrace->pcTraceIt;
+        ++cpuTrace->pcTraceIdx;
     }
 
-    if (cpuTrace->pcTraceIt == cpuTrace->pcTrace.end()){
-        LOG_INFO("Reached end of trace!");
-        cpuTrace->pcTraceIt = cpuTrace->pcTrace.end() -1;
+    dbg_state.signum    = 0x05;         // SIGTRAP
+
+    if (cpuTrace->pcTraceIdx >= pcTraceSize()){
+        if (interrupted){
+            dbg_state.signum    = 0x02;     // SIGINT
+        }
+        else{
+            LOG_INFO("Reached end of trace!");
+        }
+        cpuTrace->pcTraceIdx = pcTraceSize()-1;
     }
 
     print_pc(cpuTrace);
 
-    dbg_state.signum    = 0x05;         // SIGTRAP
     dbg_sys_update_state();
 
     return 0;
@@ -162,13 +289,20 @@ int dbg_sys_continue(void)
 
 int dbg_sys_step(void)
 {
-    if (cpuTrace->pcTraceIt != cpuTrace->pcTrace.end()){
-        ++cpuTrace->pcTraceIt;
+    if (cpuTrace->pcTraceIdx < pcTraceSize()){
+        ++cpuTrace->pcTraceIdx;
     }
 
-    if (cpuTrace->pcTraceIt == cpuTrace->pcTrace.end()){
+    if (!pcAvailable(cpuTrace->pcTraceIdx)){
+        cpuTrace->pcTraceIdx = pcTraceSize()-1;
+
+        if (interrupted){
+            dbg_state.signum    = 0x02;     // SIGINT
+            dbg_sys_update_state();
+            return 0;
+        }
+
         LOG_INFO("Reached end of trace!");
-        cpuTrace->pcTraceIt = cpuTrace->pcTrace.end()-1;
 
         // -1 will ultimately result in a terminate message.
         return -1;
@@ -186,7 +320,7 @@ int dbg_sys_step(void)
 
 int dbg_sys_restart(void)
 {
-    cpuTrace->pcTraceIt = cpuTrace->pcTrace.begin();
+    cpuTrace->pcTraceIdx = 0;
     return 0;
 }
 
@@ -30,6 +30,7 @@
 #include "CpuTrace.h"
 #include "RegFileTrace.h"
 #include "MemTrace.h"
+#include "TraceLoader.h"
 
 /*****************************************************************************
  * Types
@@ -131,8 +132,9 @@ extern void const * const dbg_int_handlers[];
  * Prototypes
  ****************************************************************************/
 
-void dbg_sys_init(TcpServer &tS, CpuTrace &cT, RegFileTrace &rT, MemTrace &mT);
+void dbg_sys_init(TcpServer &tS, TraceLoader &tL, CpuTrace &cT, RegFileTrace &rT, MemTrace &mT);
 void dbg_sys_update_state();
+void dbg_sys_update_registers();
 
 int dbg_hook_idt(uint8_t vector, const void *function);
 int dbg_init_gates(void);
@@ -13,6 +13,8 @@
 #include "RegFileTrace.h"
 #include "FstProcess.h"
 #include "TcpServer.h"
+#include "TraceCache.h"
+#include "TraceLoader.h"
 #include "gdbstub.h"
 
 #define DEVELOP   1
@@ -24,6 +26,8 @@ bool verbose = false;
 struct ConfigParams {
     string fstFileName; 
     string cpuClkSignal;
+    uint64_t cpuClkPeriod = 0;
+    uint64_t cpuClkFirstFallingEdge = 0;
     string retiredPcSignal;
     string retiredPcValidSignal;
 
@@ -42,6 +46,12 @@ struct ConfigParams {
 
     string memInitFileName;
     int memInitStartAddr;
+
+    uint64_t regFileCheckpointInterval = 0;
+    uint64_t regFileCheckpointMemBudgetMB = 0;
+    uint64_t memSnapshotInterval = 0;
+
+    string pcTraceEncoding;
 };
 
 string get_scope(string full_path)
@@ -81,9 +91,14 @@ static inline void trim(std::string &s) {
 void help()
 {
     LOG_INFO("Usage: gdbwave <options>");
-    LOG_INFO("    -w <FST waveform file>");
+    LOG_INFO("    -w <FST or VCD waveform file>");
     LOG_INFO("    -c <config parameter file>");
     LOG_INFO("    -p <port nr>");
+    LOG_INFO("    -j <nr of decoder threads>: with 3 or more, each extractor decodes on its own thread");
+    LOG_INFO("    -t <start time>:<end time> only load a time window, load later windows on demand");
+    LOG_INFO("    -f follow an FST file that is still being written by the simulator");
+    LOG_INFO("    -n don't use the trace cache file (<FST waveform file>.gdbwave)");
+    LOG_INFO("    -s <dir> spill the traces to memory-mapped temporary files in dir, for traces that don't fit in memory");
     LOG_INFO("    -v verbose");
     LOG_INFO("");
     LOG_INFO("Example: ./gdbwave -w ./test_data/top.fst -c ./test_data/configParams.txt");
@@ -108,6 +123,10 @@ void parseConfig(ifstream & configFile, ConfigParams &c)
 
         if (name == "cpuClk")
             c.cpuClkSignal                  = value;
+        else if (name == "cpuClkPeriod")
+            c.cpuClkPeriod                  = stoull(value);
+        else if (name == "cpuClkFirstFallingEdge")
+            c.cpuClkFirstFallingEdge        = stoull(value);
         else if (name == "retiredPc")
             c.retiredPcSignal               = value;
         else if (name == "retiredPcValid")
@@ -140,6 +159,14 @@ void parseConfig(ifstream & configFile, ConfigParams &c)
             c.memInitFileName               = value;
         else if (name == "memInitStartAddr")
             c.memInitStartAddr              = stoi(value);
+        else if (name == "regFileCheckpointInterval")
+            c.regFileCheckpointInterval     = stoull(value);
+        else if (name == "regFileCheckpointMemBudgetMB")
+            c.regFileCheckpointMemBudgetMB  = stoull(value);
+        else if (name == "memSnapshotInterval")
+            c.memSnapshotInterval           = stoull(value);
+        else if (name == "pcTraceEncoding")
+            c.pcTraceEncoding               = value;
 
         else{
             LOG_ERROR("Unknown configuration parameter: %s", name.c_str());
@@ -150,6 +177,26 @@ void parseConfig(ifstream & configFile, ConfigParams &c)
     }
 }
 
+// The FST file of a simulation that has just started can only be opened once the 
+// simulator has written the first block of value changes.
+void waitForFstFile(string fstFileName)
+{
+    bool waiting = false;
+    while(true){
+        try{
+            FstProcess  fstProc(fstFileName);
+            return;
+        }
+        catch(runtime_error &e){
+            if (!waiting){
+                LOG_INFO("Waiting for simulator to write '%s'...", fstFileName.c_str());
+                waiting = true;
+            }
+            sleep(1);
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
     int c;
@@ -158,11 +205,18 @@ int main(int argc, char **argv)
 
     ConfigParams configParams;
     int portNr = 3333;
+    int nrThreads = 1;
+    bool useCache = true;
+    bool useWindow = false;
+    bool followMode = false;
+    uint64_t windowStartTime = 0;
+    uint64_t windowEndTime = UINT64_MAX;
 
     string fstFileName; 
     string configParamsFileName;
+    string spillDir;
 
-    while((c = getopt(argc, argv, "hw:c:p:v")) != -1){
+    while((c = getopt(argc, argv, "hw:c:p:j:nt:fs:v")) != -1){
         switch(c){
             case 'h':
                 help();
@@ -177,6 +231,34 @@ int main(int argc, char **argv)
             case 'p':
                 portNr = stoi(optarg);
                 break;
+            case 'j':
+                nrThreads = stoi(optarg);
+                break;
+            case 'n':
+                useCache = false;
+                break;
+            case 't': {
+                string window = optarg;
+                auto delimiterPos = window.find(":");
+                if (delimiterPos == string::npos){
+                    LOG_ERROR("Time window must be specified as <start time>:<end time>");
+                    return 1;
+                }
+                string startStr = window.substr(0, delimiterPos);
+                string endStr   = window.substr(delimiterPos+1);
+                if (!startStr.empty())
+                    windowStartTime = stoull(startStr);
+                if (!endStr.empty())
+                    windowEndTime   = stoull(endStr);
+                useWindow = true;
+                break;
+            }
+            case 'f':
+                followMode = true;
+                break;
+            case 's':
+                spillDir = optarg;
+                break;
             case 'v':
                 verbose = true;
                 break;
@@ -207,7 +289,8 @@ int main(int argc, char **argv)
     ifstream configFile(configParamsFileName, ios::in);
     parseConfig(configFile, configParams);
 
-    if (configParams.cpuClkSignal.empty()){
+    // With a known clock period, the clock signal isn't needed.
+    if (configParams.cpuClkSignal.empty() && configParams.cpuClkPeriod == 0){
         LOG_ERROR("CPU clock signal not specified!");
         return 1;
     }
@@ -222,6 +305,10 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (followMode){
+        waitForFstFile(fstFileName);
+    }
+
     FstProcess  fstProc(fstFileName);
     LOG_INFO("%s", fstProc.infoStr().c_str());
 
@@ -251,8 +338,83 @@ int main(int argc, char **argv)
                              memCmdValidSig, memCmdReadySig, memCmdAddrSig, memCmdSizeSig, memCmdWrSig, memCmdWrDataSig, 
                              memRspValidSig, memRspDataSig);
 
+    if (configParams.cpuClkPeriod != 0){
+        LOG_INFO("Clock-free sampling: clock period %ld, first falling edge at %ld", configParams.cpuClkPeriod, configParams.cpuClkFirstFallingEdge);
+
+        ClkSampler clkSampler(configParams.cpuClkPeriod, configParams.cpuClkFirstFallingEdge);
+        cpuTrace.clkSampler     = clkSampler;
+        regFileTrace.clkSampler = clkSampler;
+        memTrace.clkSampler     = clkSampler;
+    }
+
+    if (configParams.regFileCheckpointInterval != 0){
+        regFileTrace.checkpointInterval     = configParams.regFileCheckpointInterval;
+    }
+    if (configParams.regFileCheckpointMemBudgetMB != 0){
+        regFileTrace.checkpointMemBudget    = configParams.regFileCheckpointMemBudgetMB << 20;
+    }
+    if (configParams.memSnapshotInterval != 0){
+        memTrace.snapshotInterval           = configParams.memSnapshotInterval;
+        memTrace.defaultSnapshotInterval    = false;
+    }
+
+    if (configParams.pcTraceEncoding == "branches"){
+        // The instruction lengths come from the code in the memory init image.
+        memTrace.loadMemInitFile();
+        cpuTrace.pcTrace.setBranchMode(&memTrace.memInitContents, memTrace.memInitStartAddr);
+    }
+    else if (!configParams.pcTraceEncoding.empty() && configParams.pcTraceEncoding != "deltas"){
+        LOG_ERROR("Unknown PC trace encoding: %s", configParams.pcTraceEncoding.c_str());
+        exit(1);
+    }
+
+    if (!spillDir.empty()){
+        LOG_INFO("Spilling traces to %s", spillDir.c_str());
+        spillTraceChunks(spillDir);
+    }
+
+    vector<string> signalNames = {
+        configParams.cpuClkSignal,
+        configParams.retiredPcSignal, configParams.retiredPcValidSignal,
+        configParams.regFileWriteValidSignal, configParams.regFileWriteAddrSignal, configParams.regFileWriteDataSignal,
+        configParams.memCmdValidSignal, configParams.memCmdReadySignal, configParams.memCmdAddrSignal, configParams.memCmdSizeSignal,
+        configParams.memCmdWrSignal, configParams.memCmdWrDataSignal, configParams.memRspValidSignal, configParams.memRspRdDataSignal 
+    };
+
+    // A trace that was sampled with a different clock must not be loaded from the cache.
+    if (configParams.cpuClkPeriod != 0){
+        signalNames.push_back("clock period " + to_string(configParams.cpuClkPeriod) + ", first falling edge " + to_string(configParams.cpuClkFirstFallingEdge));
+    }
+
+    // In branch mode, the PC trace can only be decoded with the same code image.
+    if (cpuTrace.pcTrace.branchMode){
+        string image(memTrace.memInitContents.begin(), memTrace.memInitContents.end());
+        signalNames.push_back("pc trace encoding branches, code image " + to_string(hash<string>()(image)));
+    }
+
+    // The indexes in the cache file are only used when they were built with the same settings.
+    vector<string> indexSettings = {
+        "register file checkpoint interval " + to_string(regFileTrace.checkpointInterval) + ", budget " + to_string(regFileTrace.checkpointMemBudget),
+        "memory snapshot interval " + (memTrace.defaultSnapshotInterval ? string("default") : to_string(memTrace.snapshotInterval))
+    };
+
+    TraceCache  traceCache(fstProc, signalNames, indexSettings);
+    // The cache is never valid for an FST file that is still being written.
+    if (followMode){
+        useCache = false;
+    }
+
+    TraceLoader traceLoader(fstProc, cpuTrace, regFileTrace, memTrace, useCache ? &traceCache : nullptr, nrThreads, followMode);
+
+    if (useWindow){
+        traceLoader.loadWindow(windowStartTime, windowEndTime);
+    }
+    else{
+        traceLoader.load();
+    }
+
     TcpServer tcpServer(portNr);
-    dbg_sys_init(tcpServer, cpuTrace, regFileTrace, memTrace);
+    dbg_sys_init(tcpServer, traceLoader, cpuTrace, regFileTrace, memTrace);
 
     return 0;
 }